@@ -6,6 +6,7 @@
 #include "ECS/ECSEvent.h"
 #include "ECS/ECSStat.h"
 #include "QuadTree.h"
+#include "Narrowphase.h"
 
 template<typename T> bool IsValid(const T& v)
 {
@@ -23,9 +24,28 @@ enum class EStatId : int
 	_Count
 };
 
+// Render data double buffered by frame, for BaseGameInstance::pipelined_render.
+template<typename TItem>
+struct RenderSnapshot
+{
+	std::vector<TItem> buffers[2];
+
+	std::vector<TItem>& ToWrite(int64_t frame) { return buffers[frame % 2]; }
+	const std::vector<TItem>& ToRender(int64_t snapshot) const { return buffers[snapshot % 2]; }
+};
+
 struct BaseGameInstance
 {
 	QuadTree<ECS::EntityId> quad_tree;
+	DoubleBufferedQuadTree<ECS::EntityId, ECS::kMaxConcurrentWorkerThreads + 1> rebuilt_quad_tree;
+	bool rebuild_quad_tree = false; // otherwise quad_tree is updated incrementally
+	uint32_t reported_quad_tree_dropped = 0;
+
+	constexpr static const uint16_t kBroadphaseParts = ECS::kMaxConcurrentWorkerThreads + 1;
+	constexpr static const uint32_t kBroadphasePhases = QuadTree<ECS::EntityId>::kPairPhases;
+	std::vector<ECS::EntityPair> broadphase_pairs[kBroadphasePhases][kBroadphaseParts];
+	std::vector<ECS::EntityPair> broadphase_serial_pairs[kBroadphaseParts]; // with an entity too big for the phases
+	std::vector<uint32_t> narrowphase_hits[kBroadphaseParts];
 	ECS::ECSManagerAsync ecs;
 	ECS::EventManager event_manager;
 
@@ -34,15 +54,49 @@ struct BaseGameInstance
 
 	sf::RenderWindow window;
 
-	float frame_time_seconds = 0.0f;
+	float frame_time_seconds = 0.0f; // simulated by the current tick
 	uint64_t frames = 0;
 
+	// Fixed timestep: every frame runs the simulation ticks of the elapsed time, frame_time_seconds is tick_seconds.
+	// The time above max_ticks_per_frame ticks is dropped. Graphic tasks run after the ticks, interpolated by render_alpha.
+	bool fixed_timestep = false;
+	float tick_seconds = 1.0f / 60.0f;
+	uint32_t max_ticks_per_frame = 4;
+	double tick_accumulator = 0.0;
+	float render_alpha = 1.0f; // between the previous and the last tick
+	uint64_t ticks = 0;
+
 	std::atomic_bool close_request = false;
 
+	// Pipelined render: the simulation writes a snapshot of the render data of the frame and publishes it. The render thread
+	// draws the last published snapshot, while the next frame is simulated. Render must not touch components then.
+	bool pipelined_render = false;
+	std::atomic_int64_t published_snapshot = -1;
+	std::atomic_int64_t rendered_snapshot = -1;
+	int64_t snapshot_to_render = -1; // render thread only
+
+	// The render thread reads only snapshots newer than the rendered one.
+	bool SnapshotWritable(int64_t frame) const
+	{
+		return rendered_snapshot.load(std::memory_order_acquire) >= frame - 2;
+	}
+
+	// Call it when the snapshot is complete, before wait_for_graphic_update is opened.
+	void PublishSnapshot(int64_t frame)
+	{
+		published_snapshot.store(frame, std::memory_order_release);
+	}
+
+	const QuadTree<ECS::EntityId>& GetQuadTree() const
+	{
+		return rebuild_quad_tree ? rebuilt_quad_tree.Front() : quad_tree;
+	}
+
 	static BaseGameInstance* inst;
 	static BaseGameInstance* CreateGameInstance();
 	
 	virtual void InitializeGame() {}
-	virtual void DispatchTasks() {} // should open wait_for_graphic_update
-	virtual void Render() {}
+	virtual void DispatchTasks() {} // a simulation tick
+	virtual void DispatchGraphicTasks() {} // should open wait_for_graphic_update
+	virtual void Render() {} // called from the render thread
 };
@@ -5,6 +5,10 @@ using namespace ECS;
 
 BaseGameInstance* BaseGameInstance::inst = nullptr;
 
+#if ECS_STAT_ENABLED
+constexpr int64_t kTraceFrameNum = 3; // captured after T is pressed
+#endif
+
 void RenderLoop()
 {
 	auto& inst = *BaseGameInstance::inst;
@@ -12,14 +16,28 @@ void RenderLoop()
 
 	while (!inst.close_request)
 	{
-		inst.window.clear();
 		{
 			ScopeDurationLog __sdl(EStatId::Graphic_WaitForUpdate, EPredefinedStatGroups::Framework);
 			inst.wait_for_graphic_update.WaitEnterClose();
 		}
 
+		if (inst.pipelined_render)
+		{
+			// The gate may open again without a new snapshot, the displayed frame is kept then.
+			const int64_t snapshot = inst.published_snapshot.load(std::memory_order_acquire);
+			if (snapshot <= inst.snapshot_to_render)
+				continue;
+			ScopeDurationLog __sdl(EStatId::Graphic_RenderSync, EPredefinedStatGroups::Framework);
+			inst.window.clear();
+			inst.snapshot_to_render = snapshot;
+			inst.Render();
+			inst.rendered_snapshot.store(snapshot, std::memory_order_release);
+			inst.ecs.Wake();
+		}
+		else
 		{
 			ScopeDurationLog __sdl(EStatId::Graphic_RenderSync, EPredefinedStatGroups::Framework);
+			inst.window.clear();
 			inst.Render();
 			inst.wait_for_render_sync.Open();
 		}
@@ -41,42 +59,68 @@ void HandleSystemEvents()
 		{
 #if ECS_STAT_ENABLED
 			ECS::Stat::LogAll(inst.frames);
+			inst.ecs.LogTaskGraphAnalysis();
 #endif
 			inst.close_request = true;
 		}
+#if ECS_STAT_ENABLED
+		else if ((event.type == sf::Event::KeyPressed) && (event.key.code == sf::Keyboard::T))
+		{
+			// the next frames
+			ECS::Trace::Request(inst.frames + 1, kTraceFrameNum, "trace.json");
+		}
+#endif
 	}
 }
 
-void MainLoopBody()
+// Dispatches the tasks and waits for them, then handles the events they pushed.
+void RunTaskBatch(bool simulate, bool graphic)
 {
-	ScopeDurationLog __sdl(EStatId::GameFrame, EPredefinedStatGroups::Framework);
-	const auto frame_start = std::chrono::system_clock::now();
 	auto& inst = *BaseGameInstance::inst;
-
-	HandleSystemEvents();
-	if(inst.close_request) 
-		return;
-
+	inst.ecs.DeliverObservers(); // changes since the previous batch, including the initialization
 	{
 		ECS::DebugLockScope __dls(inst.ecs);
-		inst.DispatchTasks();
-		inst.ecs.WorkFromMainThread(false);
-
+		if (graphic && inst.pipelined_render)
 		{
+			// the snapshot buffer of the frame is free, when the render thread is done with the frame before the previous one
 			ScopeDurationLog __sdl(EStatId::Graphic_WaitForRenderSync, EPredefinedStatGroups::Framework);
-			inst.wait_for_render_sync.WaitEnterClose();
+			const int64_t frame = static_cast<int64_t>(inst.frames);
+			inst.ecs.HelpUntil([&inst, frame]() { return inst.SnapshotWritable(frame); });
 		}
-
-		while (inst.ecs.AnyWorkerIsBusy())
+		if (simulate)
 		{
-			std::this_thread::yield();
+			inst.DispatchTasks();
 		}
+		if (graphic)
+		{
+			inst.DispatchGraphicTasks();
+			if (!inst.pipelined_render)
+			{
+				// includes the tasks executed meanwhile
+				ScopeDurationLog __sdl(EStatId::Graphic_WaitForRenderSync, EPredefinedStatGroups::Framework);
+				inst.ecs.HelpUntilEnterClose(inst.wait_for_render_sync);
+			}
+		}
+
+		inst.ecs.WaitForAllTasks();
 		inst.ecs.ResetCompletedTasks();
+		if (simulate && inst.rebuild_quad_tree)
+		{
+			inst.rebuilt_quad_tree.Swap();
+			const uint32_t dropped = inst.rebuilt_quad_tree.Dropped();
+			if (dropped != inst.reported_quad_tree_dropped)
+			{
+				// reported when the number changes, not every frame
+				printf_s("Quad tree rebuild: %u entries did not fit into full leaves (frame %llu)\n", dropped, inst.frames);
+				inst.reported_quad_tree_dropped = dropped;
+			}
+		}
 	}
 
+	inst.event_manager.DrainChannels();
 	{
 		EventStorage storage;
-		while (BaseGameInstance::inst->event_manager.Pop(storage))
+		while (inst.event_manager.Pop(storage))
 		{
 			IEvent* e = storage.Get();
 			assert(e);
@@ -85,10 +129,58 @@ void MainLoopBody()
 				e->Execute();
 			}
 		}
+		inst.event_manager.ResetFrameArena();
+	}
+}
+
+void MainLoopBody()
+{
+#if ECS_STAT_ENABLED
+	ECS::Stat::EndFrame(); // of the previous frame
+	ECS::Trace::OnFrame(BaseGameInstance::inst->frames);
+#endif
+	ScopeDurationLog __sdl(EStatId::GameFrame, EPredefinedStatGroups::Framework);
+	const auto frame_start = std::chrono::system_clock::now();
+	auto& inst = *BaseGameInstance::inst;
+
+	HandleSystemEvents();
+	if(inst.close_request) 
+		return;
+
+	if (inst.fixed_timestep)
+	{
+		uint32_t tick_num = static_cast<uint32_t>(inst.tick_accumulator / inst.tick_seconds);
+		if (tick_num > inst.max_ticks_per_frame)
+		{
+			tick_num = inst.max_ticks_per_frame;
+			inst.tick_accumulator = tick_num * inst.tick_seconds; // the rest is dropped, instead of spiralling
+		}
+		inst.tick_accumulator -= tick_num * inst.tick_seconds;
+		inst.frame_time_seconds = inst.tick_seconds;
+		for (uint32_t idx = 0; idx < tick_num; idx++)
+		{
+			RunTaskBatch(true, false);
+			inst.ticks++;
+		}
+		inst.render_alpha = static_cast<float>(inst.tick_accumulator / inst.tick_seconds);
+		RunTaskBatch(false, true);
+	}
+	else
+	{
+		inst.render_alpha = 1.0f;
+		RunTaskBatch(true, true);
+		inst.ticks++;
 	}
 
 	const auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - frame_start);
-	inst.frame_time_seconds = duration_us.count() / 1000000.0f;
+	if (inst.fixed_timestep)
+	{
+		inst.tick_accumulator += duration_us.count() / 1000000.0;
+	}
+	else
+	{
+		inst.frame_time_seconds = duration_us.count() / 1000000.0f;
+	}
 	LOG("Frame %d time: %7.3f[ms]", inst.frames, duration_us.count() / 1000.0f);
 	inst.frames++;
 }
@@ -100,6 +192,7 @@ int main()
 		auto& inst = *BaseGameInstance::inst;
 
 		inst.InitializeGame();
+		inst.ecs.SetTaskCompletedHook([]() { BaseGameInstance::inst->event_manager.FlushCurrentThread(); });
 		inst.ecs.StartThreads();
 		{
 			inst.window.create(sf::VideoMode(800, 600), "HnS");
@@ -109,6 +202,7 @@ int main()
 #if ECS_STAT_ENABLED
 			MainLoopBody(); //Remove first stat pass
 			ECS::Stat::Reset();
+			inst.ecs.ResetTaskGraphAnalysis();
 #endif
 			while (!BaseGameInstance::inst->close_request)
 			{
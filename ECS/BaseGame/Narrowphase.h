@@ -0,0 +1,135 @@
+#pragma once
+#include <cstdint>
+#include "ECS/ECSBase.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NARROWPHASE_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define NARROWPHASE_SSE2 1
+#endif
+
+// Views indexed by entity id, so they can point straight into DenseComponentContainer data. Strides are in floats.
+struct CircleBodies
+{
+	const float* pos_x = nullptr;
+	const float* pos_y = nullptr;
+	uint32_t pos_stride = 0;
+	const float* radius = nullptr;
+	uint32_t radius_stride = 0;
+	const float* vel_x = nullptr;
+	const float* vel_y = nullptr;
+	uint32_t vel_stride = 0;
+};
+
+// Overlapping circles, that get closer during update_time.
+inline bool ApproachingCircleOverlap(const CircleBodies& bodies, const uint32_t a, const uint32_t b, const float update_time)
+{
+	const float diff_x = bodies.pos_x[b * bodies.pos_stride] - bodies.pos_x[a * bodies.pos_stride];
+	const float diff_y = bodies.pos_y[b * bodies.pos_stride] - bodies.pos_y[a * bodies.pos_stride];
+	const float dist_sq = diff_x * diff_x + diff_y * diff_y;
+	const float radius_sum = bodies.radius[a * bodies.radius_stride] + bodies.radius[b * bodies.radius_stride];
+
+	const float next_diff_x = diff_x + (bodies.vel_x[b * bodies.vel_stride] - bodies.vel_x[a * bodies.vel_stride]) * update_time;
+	const float next_diff_y = diff_y + (bodies.vel_y[b * bodies.vel_stride] - bodies.vel_y[a * bodies.vel_stride]) * update_time;
+	const float next_dist_sq = next_diff_x * next_diff_x + next_diff_y * next_diff_y;
+
+	return (dist_sq < radius_sum * radius_sum) && (next_dist_sq < dist_sq);
+}
+
+// Writes indices of the pairs that pass ApproachingCircleOverlap into out_hits (room for pairs_num) and returns their number.
+// 8 pairs per iteration with AVX2 or SSE2, the tail and other targets go through the scalar test.
+inline uint32_t FindApproachingCircleOverlaps(const ECS::EntityPair* pairs, const uint32_t pairs_num
+	, const CircleBodies& bodies, const float update_time, uint32_t* out_hits)
+{
+	static_assert(sizeof(ECS::EntityPair) == 2 * sizeof(uint16_t), "pair is expected to be packed as two 16 bit ids");
+	uint32_t hits_num = 0;
+	uint32_t idx = 0;
+
+#if NARROWPHASE_AVX2
+	const __m256i low_mask = _mm256_set1_epi32(0xFFFF);
+	const __m256i pos_stride = _mm256_set1_epi32(static_cast<int>(bodies.pos_stride));
+	const __m256i radius_stride = _mm256_set1_epi32(static_cast<int>(bodies.radius_stride));
+	const __m256i vel_stride = _mm256_set1_epi32(static_cast<int>(bodies.vel_stride));
+	const __m256 time = _mm256_set1_ps(update_time);
+	for (; idx + 8 <= pairs_num; idx += 8)
+	{
+		const __m256i packed = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pairs + idx));
+		const __m256i ids_a = _mm256_and_si256(packed, low_mask);
+		const __m256i ids_b = _mm256_srli_epi32(packed, 16);
+		const __m256i pos_a = _mm256_mullo_epi32(ids_a, pos_stride);
+		const __m256i pos_b = _mm256_mullo_epi32(ids_b, pos_stride);
+		const __m256i vel_a = _mm256_mullo_epi32(ids_a, vel_stride);
+		const __m256i vel_b = _mm256_mullo_epi32(ids_b, vel_stride);
+
+		const __m256 diff_x = _mm256_sub_ps(_mm256_i32gather_ps(bodies.pos_x, pos_b, 4), _mm256_i32gather_ps(bodies.pos_x, pos_a, 4));
+		const __m256 diff_y = _mm256_sub_ps(_mm256_i32gather_ps(bodies.pos_y, pos_b, 4), _mm256_i32gather_ps(bodies.pos_y, pos_a, 4));
+		const __m256 dist_sq = _mm256_add_ps(_mm256_mul_ps(diff_x, diff_x), _mm256_mul_ps(diff_y, diff_y));
+		const __m256 radius_sum = _mm256_add_ps(_mm256_i32gather_ps(bodies.radius, _mm256_mullo_epi32(ids_a, radius_stride), 4)
+			, _mm256_i32gather_ps(bodies.radius, _mm256_mullo_epi32(ids_b, radius_stride), 4));
+
+		const __m256 rel_vel_x = _mm256_sub_ps(_mm256_i32gather_ps(bodies.vel_x, vel_b, 4), _mm256_i32gather_ps(bodies.vel_x, vel_a, 4));
+		const __m256 rel_vel_y = _mm256_sub_ps(_mm256_i32gather_ps(bodies.vel_y, vel_b, 4), _mm256_i32gather_ps(bodies.vel_y, vel_a, 4));
+		const __m256 next_diff_x = _mm256_add_ps(diff_x, _mm256_mul_ps(rel_vel_x, time));
+		const __m256 next_diff_y = _mm256_add_ps(diff_y, _mm256_mul_ps(rel_vel_y, time));
+		const __m256 next_dist_sq = _mm256_add_ps(_mm256_mul_ps(next_diff_x, next_diff_x), _mm256_mul_ps(next_diff_y, next_diff_y));
+
+		const __m256 hit = _mm256_and_ps(_mm256_cmp_ps(dist_sq, _mm256_mul_ps(radius_sum, radius_sum), _CMP_LT_OQ)
+			, _mm256_cmp_ps(next_dist_sq, dist_sq, _CMP_LT_OQ));
+		const int mask = _mm256_movemask_ps(hit);
+		for (uint32_t lane = 0; mask && (lane < 8); lane++)
+		{
+			if (mask & (1 << lane))
+			{
+				out_hits[hits_num++] = idx + lane;
+			}
+		}
+	}
+#elif NARROWPHASE_SSE2
+	const __m128 time = _mm_set1_ps(update_time);
+	auto gather = [](const float* base, const uint32_t stride, const uint32_t (&ids)[4]) -> __m128
+	{
+		return _mm_set_ps(base[ids[3] * stride], base[ids[2] * stride], base[ids[1] * stride], base[ids[0] * stride]);
+	};
+	for (; idx + 8 <= pairs_num; idx += 8)
+	{
+		for (uint32_t half = 0; half < 8; half += 4)
+		{
+			const uint32_t first = idx + half;
+			const uint32_t ids_a[4] = { pairs[first].a, pairs[first + 1].a, pairs[first + 2].a, pairs[first + 3].a };
+			const uint32_t ids_b[4] = { pairs[first].b, pairs[first + 1].b, pairs[first + 2].b, pairs[first + 3].b };
+
+			const __m128 diff_x = _mm_sub_ps(gather(bodies.pos_x, bodies.pos_stride, ids_b), gather(bodies.pos_x, bodies.pos_stride, ids_a));
+			const __m128 diff_y = _mm_sub_ps(gather(bodies.pos_y, bodies.pos_stride, ids_b), gather(bodies.pos_y, bodies.pos_stride, ids_a));
+			const __m128 dist_sq = _mm_add_ps(_mm_mul_ps(diff_x, diff_x), _mm_mul_ps(diff_y, diff_y));
+			const __m128 radius_sum = _mm_add_ps(gather(bodies.radius, bodies.radius_stride, ids_a), gather(bodies.radius, bodies.radius_stride, ids_b));
+
+			const __m128 rel_vel_x = _mm_sub_ps(gather(bodies.vel_x, bodies.vel_stride, ids_b), gather(bodies.vel_x, bodies.vel_stride, ids_a));
+			const __m128 rel_vel_y = _mm_sub_ps(gather(bodies.vel_y, bodies.vel_stride, ids_b), gather(bodies.vel_y, bodies.vel_stride, ids_a));
+			const __m128 next_diff_x = _mm_add_ps(diff_x, _mm_mul_ps(rel_vel_x, time));
+			const __m128 next_diff_y = _mm_add_ps(diff_y, _mm_mul_ps(rel_vel_y, time));
+			const __m128 next_dist_sq = _mm_add_ps(_mm_mul_ps(next_diff_x, next_diff_x), _mm_mul_ps(next_diff_y, next_diff_y));
+
+			const __m128 hit = _mm_and_ps(_mm_cmplt_ps(dist_sq, _mm_mul_ps(radius_sum, radius_sum)), _mm_cmplt_ps(next_dist_sq, dist_sq));
+			const int mask = _mm_movemask_ps(hit);
+			for (uint32_t lane = 0; mask && (lane < 4); lane++)
+			{
+				if (mask & (1 << lane))
+				{
+					out_hits[hits_num++] = first + lane;
+				}
+			}
+		}
+	}
+#endif
+
+	for (; idx < pairs_num; idx++)
+	{
+		if (ApproachingCircleOverlap(bodies, pairs[idx].a, pairs[idx].b, update_time))
+		{
+			out_hits[hits_num++] = idx;
+		}
+	}
+	return hits_num;
+}
\ No newline at end of file
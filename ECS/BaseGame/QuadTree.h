@@ -1,18 +1,31 @@
 #pragma once
 #include "malloc.h"
 #include <array>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <bit>
 
-template<typename Element, uint32_t kMaxElementsPerLeaf = 16, uint32_t kResolutionX = 64, uint32_t kResolutionY = 64>
+constexpr static const uint32_t kQuadTreeCacheLineSize = 64;
+
+// By default a leaf (count + elements) fills exactly one cache line.
+template<typename Element, uint32_t kMaxElementsPerLeaf = (kQuadTreeCacheLineSize - sizeof(uint16_t)) / sizeof(Element)
+	, uint32_t kResolutionX = 64, uint32_t kResolutionY = 64>
 struct QuadTree
 {
-	struct Leaf
+	// Elements are sorted, only the first count are meaningful.
+	struct alignas(kQuadTreeCacheLineSize) Leaf
 	{
+		uint16_t count = 0;
 		std::array <Element, kMaxElementsPerLeaf> data = { Element{} };
 	};
 
-	static_assert(alignof(Element) == alignof(Leaf), "");
+	static_assert(kMaxElementsPerLeaf < UINT16_MAX, "");
+	static_assert(kResolutionY <= 64, "occupancy of a column is a single 64 bit mask");
 
-	Leaf entities[kResolutionX][kResolutionX] = {};
+	Leaf entities[kResolutionX][kResolutionY] = {};
+	uint64_t occupied[kResolutionX] = {}; // bit y is set, when entities[x][y] is not empty
 
 	struct Region
 	{
@@ -37,6 +50,24 @@ struct QuadTree
 			assert(y < max_y);
 			return (x - min_x) * SizeY() * (y - min_y);
 		}
+
+		// Occupancy bits of the region rows in a column.
+		uint64_t ColumnMask() const
+		{
+			assert(IsValid());
+			return ((SizeY() < 64) ? ((uint64_t(1) << SizeY()) - 1) : ~uint64_t(0)) << min_y;
+		}
+
+		// Splits the whole tree into part_num column ranges. Boundaries are multiples of alignment.
+		static Region Columns(uint32_t part_idx, uint32_t part_num, uint32_t alignment = 1)
+		{
+			assert(part_idx < part_num);
+			assert(alignment > 0);
+			const uint32_t units = (kResolutionX + alignment - 1) / alignment;
+			const uint32_t max_x = (part_idx + 1 == part_num) ? kResolutionX : ((part_idx + 1) * units / part_num) * alignment;
+			return Region{ static_cast<uint8_t>((part_idx * units / part_num) * alignment), 0
+				, static_cast<uint8_t>(max_x), static_cast<uint8_t>(kResolutionY) };
+		}
 	};
 
 	template<typename TFunc, typename... Args>
@@ -63,9 +94,37 @@ struct QuadTree
 		}
 	}
 
+	bool IsOccupied(uint32_t x, uint32_t y) const
+	{
+		return (occupied[x] >> y) & 1;
+	}
+
+	// Calls func(x, y, leaf) only for not empty leaves, found by the occupancy bits.
+	template<typename TFunc>
+	void ForEveryOccupiedLeafInRegion(const Region region, TFunc func) const
+	{
+		const uint64_t mask = region.ColumnMask();
+		for (uint32_t x = region.min_x; x < region.max_x; x++)
+		{
+			for (uint64_t bits = occupied[x] & mask; bits; bits &= bits - 1)
+			{
+				const uint32_t y = static_cast<uint32_t>(std::countr_zero(bits));
+				func(x, y, entities[x][y]);
+			}
+		}
+	}
+
+	// Only occupied leaves are cleared. Elements behind count are left as they are.
 	void Reset()
 	{
-		ForEveryLeafInRegion(Region{ 0, 0, kResolutionX , kResolutionY }, [](Leaf& leaf) { leaf = Leaf{}; });
+		for (uint32_t x = 0; x < kResolutionX; x++)
+		{
+			for (uint64_t bits = occupied[x]; bits; bits &= bits - 1)
+			{
+				entities[x][std::countr_zero(bits)].count = 0;
+			}
+			occupied[x] = 0;
+		}
 	}
 
 	static_assert(std::is_trivially_copyable_v<Element>);
@@ -74,43 +133,40 @@ struct QuadTree
 	{
 		ForEveryLeafInRegion(region, [](Leaf& leaf, const Element id)
 		{
-			assert(!::IsValid(leaf.data[kMaxElementsPerLeaf - 1]));
-			int64_t idx_insert = 0;
-			for (; idx_insert < kMaxElementsPerLeaf; idx_insert++)
+			assert(leaf.count < kMaxElementsPerLeaf);
+			uint32_t idx_insert = 0;
+			for (; idx_insert < leaf.count; idx_insert++)
 			{
-				auto& it_id = leaf.data[idx_insert];
-				if (!::IsValid(it_id))
-				{
-					it_id = id;
-					return;
-				}
+				const auto& it_id = leaf.data[idx_insert];
 				if (it_id == id)
 					return;
 				if (it_id > id)
 					break;
 			}
-			if (idx_insert >= kMaxElementsPerLeaf)
+			if (leaf.count >= kMaxElementsPerLeaf)
 			{
 				assert(false);
 				return;
 			}
-			int64_t idx_first_invalid = idx_insert + 1;
-			for (; (idx_first_invalid < kMaxElementsPerLeaf) && ::IsValid(leaf.data[idx_first_invalid]); idx_first_invalid++) {}
-			assert(idx_first_invalid < kMaxElementsPerLeaf);
-			memmove(&leaf.data[idx_insert + 1], &leaf.data[idx_insert], sizeof(Element) * (idx_first_invalid - idx_insert));
+			memmove(&leaf.data[idx_insert + 1], &leaf.data[idx_insert], sizeof(Element) * (leaf.count - idx_insert));
 			leaf.data[idx_insert] = id;
+			leaf.count++;
 		}, id);
+		for (uint32_t x = region.min_x; x < region.max_x; x++)
+		{
+			occupied[x] |= region.ColumnMask();
+		}
 	}
 
 	void Remove(Element id, Region region)
 	{
 		ForEveryLeafInRegion(region, [](Leaf& leaf, const Element id)
 		{
-			int64_t idx = 0;
-			for (; idx < kMaxElementsPerLeaf; idx++)
+			uint32_t idx = 0;
+			for (; idx < leaf.count; idx++)
 			{
-				auto& it_id = leaf.data[idx];
-				if (!::IsValid(it_id) || id < it_id)
+				const auto& it_id = leaf.data[idx];
+				if (id < it_id)
 				{
 					assert(false);
 					return;
@@ -118,21 +174,285 @@ struct QuadTree
 				if (id == it_id)
 					break;
 			}
-			if (idx >= kMaxElementsPerLeaf)
+			if (idx >= leaf.count)
 			{
 				assert(false);
 				return;
 			}
-			int64_t idx2 = idx + 1;
-			for (; (idx2 < kMaxElementsPerLeaf) && ::IsValid(leaf.data[idx2]); idx2++) {}
-			idx2--;
-			assert(idx2 < kMaxElementsPerLeaf);
-			if (idx2 > idx)
+			leaf.count--;
+			memmove(&leaf.data[idx], &leaf.data[idx + 1], sizeof(Element) * (leaf.count - idx));
+		}, id);
+		for (uint32_t x = region.min_x; x < region.max_x; x++)
+		{
+			for (uint32_t y = region.min_y; y < region.max_y; y++)
 			{
-				memmove_s(&leaf.data[idx], sizeof(Element) * (kMaxElementsPerLeaf - idx), &leaf.data[idx + 1], sizeof(Element) * (idx2 - idx));
+				if (!entities[x][y].count)
+				{
+					occupied[x] &= ~(uint64_t(1) << y);
+				}
 			}
-			leaf.data[idx2] = {};
-		}, id);
+		}
+	}
+
+	static bool LeafContains(const Leaf& leaf, const Element id)
+	{
+		for (uint32_t idx = 0; idx < leaf.count; idx++)
+		{
+			const Element& it_id = leaf.data[idx];
+			if (id < it_id)
+				return false;
+			if (it_id == id)
+				return true;
+		}
+		return false;
+	}
+
+	// Calls func(x, y, a, b) for every pair of elements sharing a leaf in the region, each pair once: in the first leaf
+	// of the overlap of their regions, i.e. the one where they are not both in the left nor in the upper neighbour.
+	template<typename TFunc>
+	void ForEveryPairInRegion(const Region region, TFunc func) const
+	{
+		ForEveryOccupiedLeafInRegion(region, [&](const uint32_t x, const uint32_t y, const Leaf& leaf)
+		{
+			if (leaf.count < 2)
+				return;
+			const Leaf* left = ((x > 0) && IsOccupied(x - 1, y)) ? &entities[x - 1][y] : nullptr;
+			const Leaf* upper = ((y > 0) && IsOccupied(x, y - 1)) ? &entities[x][y - 1] : nullptr;
+			for (uint32_t idx_a = 0; idx_a < leaf.count; idx_a++)
+			{
+				const Element a = leaf.data[idx_a];
+				const bool a_in_left = left && LeafContains(*left, a);
+				const bool a_in_upper = upper && LeafContains(*upper, a);
+				for (uint32_t idx_b = idx_a + 1; idx_b < leaf.count; idx_b++)
+				{
+					const Element b = leaf.data[idx_b];
+					if (a_in_left && LeafContains(*left, b))
+						continue;
+					if (a_in_upper && LeafContains(*upper, b))
+						continue;
+					func(x, y, a, b);
+				}
+			}
+		});
+	}
+
+	// Leaves are grouped in blocks of block_size x block_size, colored like a checkerboard with kPairPhases colors.
+	// If no region spans more than block_size + 1 leaves on an axis, then pairs from different blocks of a single color
+	// have no common element. So a phase can be processed in parallel per block (or per block aligned Region::Columns).
+	constexpr static const uint32_t kPairPhases = 4;
+
+	static uint32_t PairPhase(uint32_t x, uint32_t y, uint32_t block_size)
+	{
+		return ((x / block_size) & 1) | (((y / block_size) & 1) << 1);
+	}
+
+	// Pairs found by separate regions are disjoint, so the tree may be split (see Region::Columns) and walked in parallel.
+	// is_oversized(element) tells, if the element region may span more than block_size + 1 leaves.
+	// Pairs with such an element go to out_serial, they must not be processed concurrently with any phase.
+	// Pairs of the other elements keep the guarantee above.
+	template<typename TPair, typename TIsOversized>
+	void GeneratePhasedPairs(const Region region, uint32_t block_size, std::vector<TPair>* out_per_phase
+		, std::vector<TPair>& out_serial, TIsOversized is_oversized) const
+	{
+		ForEveryPairInRegion(region, [&](uint32_t x, uint32_t y, const Element a, const Element b)
+		{
+			if (is_oversized(a) || is_oversized(b))
+			{
+				out_serial.push_back(TPair{ a, b });
+				return;
+			}
+			out_per_phase[PairPhase(x, y, block_size)].push_back(TPair{ a, b });
+		});
+	}
+
+	// Coordinates below are in leaf units: leaf [x][y] covers [x, x + 1) x [y, y + 1).
+
+	// Walks the leaves crossed by the segment from -> to (clipped to the tree), in order, by DDA.
+	// Calls func(x, y, t_exit), where t_exit is the segment parameter (0 at from, 1 at to) where it leaves the leaf.
+	// Stops and returns true, when func returns true.
+	template<typename TFunc>
+	bool ForEveryLeafOnSegment(const float from_x, const float from_y, const float to_x, const float to_y, TFunc func) const
+	{
+		const float dx = to_x - from_x;
+		const float dy = to_y - from_y;
+
+		// Liang-Barsky clipping
+		float t_min = 0.0f;
+		float t_max = 1.0f;
+		const float clip_p[4] = { -dx, dx, -dy, dy };
+		const float clip_q[4] = { from_x, kResolutionX - from_x, from_y, kResolutionY - from_y };
+		for (uint32_t idx = 0; idx < 4; idx++)
+		{
+			if (clip_p[idx] == 0.0f)
+			{
+				if (clip_q[idx] < 0.0f)
+					return false;
+				continue;
+			}
+			const float t = clip_q[idx] / clip_p[idx];
+			if (clip_p[idx] < 0.0f)
+				t_min = std::max(t_min, t);
+			else
+				t_max = std::min(t_max, t);
+		}
+		if (t_min > t_max)
+			return false;
+
+		auto to_leaf = [](float coord, int32_t resolution) { return std::clamp(static_cast<int32_t>(std::floor(coord)), 0, resolution - 1); };
+		int32_t x = to_leaf(from_x + t_min * dx, kResolutionX);
+		int32_t y = to_leaf(from_y + t_min * dy, kResolutionY);
+		const int32_t step_x = (dx > 0.0f) ? 1 : ((dx < 0.0f) ? -1 : 0);
+		const int32_t step_y = (dy > 0.0f) ? 1 : ((dy < 0.0f) ? -1 : 0);
+		const float kInf = std::numeric_limits<float>::infinity();
+		const float t_delta_x = step_x ? (1.0f / std::abs(dx)) : kInf;
+		const float t_delta_y = step_y ? (1.0f / std::abs(dy)) : kInf;
+		float t_next_x = step_x ? ((x + (step_x > 0 ? 1 : 0) - from_x) / dx) : kInf;
+		float t_next_y = step_y ? ((y + (step_y > 0 ? 1 : 0) - from_y) / dy) : kInf;
+		while (true)
+		{
+			const bool step_on_x = t_next_x < t_next_y;
+			const float t_exit = std::min(step_on_x ? t_next_x : t_next_y, t_max);
+			if (func(static_cast<uint32_t>(x), static_cast<uint32_t>(y), t_exit))
+				return true;
+			if (t_exit >= t_max)
+				return false;
+			if (step_on_x)
+			{
+				x += step_x;
+				t_next_x += t_delta_x;
+			}
+			else
+			{
+				y += step_y;
+				t_next_y += t_delta_y;
+			}
+			if ((x < 0) || (x >= static_cast<int32_t>(kResolutionX)) || (y < 0) || (y >= static_cast<int32_t>(kResolutionY)))
+				return false;
+		}
+	}
+
+	// Calls func(element) for the elements in leaves crossed by the segment, ordered by leaves, each element once
+	// (a region is crossed by a monotone leaf path in consecutive leaves). Stops and returns true, when func returns true.
+	template<typename TFunc>
+	bool ForEveryElementOnSegment(const float from_x, const float from_y, const float to_x, const float to_y, TFunc func) const
+	{
+		const Leaf* previous = nullptr;
+		return ForEveryLeafOnSegment(from_x, from_y, to_x, to_y, [&](uint32_t x, uint32_t y, float)
+		{
+			const Leaf& leaf = entities[x][y];
+			for (uint32_t idx = 0; idx < leaf.count; idx++)
+			{
+				const Element element = leaf.data[idx];
+				if (previous && LeafContains(*previous, element))
+					continue;
+				if (func(element))
+					return true;
+			}
+			previous = &leaf;
+			return false;
+		});
+	}
+
+	// Returns the element with the lowest hit parameter, or an invalid element. hit(element) returns the segment parameter
+	// of the hit, or a value above 1 when missed. The hit point must lie in the region of the element, so the walk
+	// stops at the first leaf that the nearest hit found so far does not extend beyond.
+	template<typename THitFunc>
+	Element Raycast(const float from_x, const float from_y, const float to_x, const float to_y, THitFunc hit, float* out_t = nullptr) const
+	{
+		Element best{};
+		float best_t = std::numeric_limits<float>::infinity();
+		const Leaf* previous = nullptr;
+		ForEveryLeafOnSegment(from_x, from_y, to_x, to_y, [&](uint32_t x, uint32_t y, const float t_exit)
+		{
+			const Leaf& leaf = entities[x][y];
+			for (uint32_t idx = 0; idx < leaf.count; idx++)
+			{
+				const Element element = leaf.data[idx];
+				if (previous && LeafContains(*previous, element))
+					continue;
+				const float t = hit(element);
+				if ((t <= 1.0f) && (t < best_t))
+				{
+					best = element;
+					best_t = t;
+				}
+			}
+			previous = &leaf;
+			return best_t <= t_exit;
+		});
+		if (out_t)
+		{
+			*out_t = best_t;
+		}
+		return best;
+	}
+
+	// Finds up to k elements nearest to (x, y), sorted by distance, in out/out_dist (arrays of size k). No other memory is used.
+	// dist(element) returns the distance (or infinity to skip the element). It must not be lower than the distance
+	// to the region of the element, multiplied by leaf_size. Leaves are visited in rings, until no closer element may be found.
+	template<typename TDistFunc>
+	uint32_t FindNearest(const float x, const float y, const float leaf_size, const float max_dist, const uint32_t k
+		, TDistFunc dist, Element* out, float* out_dist) const
+	{
+		assert(out && out_dist);
+		uint32_t found = 0;
+		if (!k)
+			return found;
+
+		auto to_leaf = [](float coord, int32_t resolution) { return std::clamp(static_cast<int32_t>(std::floor(coord)), 0, resolution - 1); };
+		const int32_t center_x = to_leaf(x, kResolutionX);
+		const int32_t center_y = to_leaf(y, kResolutionY);
+		const int32_t max_ring = static_cast<int32_t>(std::max(kResolutionX, kResolutionY));
+
+		auto test_leaf = [&](int32_t leaf_x, int32_t leaf_y)
+		{
+			if ((leaf_x < 0) || (leaf_x >= static_cast<int32_t>(kResolutionX)) || (leaf_y < 0) || (leaf_y >= static_cast<int32_t>(kResolutionY))
+				|| !IsOccupied(leaf_x, leaf_y))
+				return;
+			const Leaf& leaf = entities[leaf_x][leaf_y];
+			for (uint32_t idx = 0; idx < leaf.count; idx++)
+			{
+				const Element element = leaf.data[idx];
+				if (std::find(out, out + found, element) != out + found)
+					continue;
+				const float element_dist = dist(element);
+				if ((element_dist > max_dist) || ((found == k) && (element_dist >= out_dist[k - 1])))
+					continue;
+				uint32_t insert_idx = (found < k) ? found++ : (k - 1);
+				for (; (insert_idx > 0) && (out_dist[insert_idx - 1] > element_dist); insert_idx--)
+				{
+					out[insert_idx] = out[insert_idx - 1];
+					out_dist[insert_idx] = out_dist[insert_idx - 1];
+				}
+				out[insert_idx] = element;
+				out_dist[insert_idx] = element_dist;
+			}
+		};
+
+		for (int32_t ring = 0; ring < max_ring; ring++)
+		{
+			// distance to the leaves of the ring and beyond
+			const float ring_dist = ring ? leaf_size * std::max(0.0f, std::min({ x - (center_x + 1 - ring), (center_x + ring) - x
+				, y - (center_y + 1 - ring), (center_y + ring) - y })) : 0.0f;
+			if ((ring_dist > max_dist) || ((found == k) && (out_dist[k - 1] <= ring_dist)))
+				break;
+			if (!ring)
+			{
+				test_leaf(center_x, center_y);
+				continue;
+			}
+			for (int32_t leaf_x = center_x - ring; leaf_x <= center_x + ring; leaf_x++)
+			{
+				test_leaf(leaf_x, center_y - ring);
+				test_leaf(leaf_x, center_y + ring);
+			}
+			for (int32_t leaf_y = center_y - ring + 1; leaf_y < center_y + ring; leaf_y++)
+			{
+				test_leaf(center_x - ring, leaf_y);
+				test_leaf(center_x + ring, leaf_y);
+			}
+		}
+		return found;
 	}
 
 	struct Iter
@@ -178,20 +498,18 @@ struct QuadTree
 				{
 					for (uint8_t y = region.min_y; y < region.max_y; y++)
 					{
+						if (!qt.IsOccupied(x, y)) continue;
 						const Leaf& leaf = qt.entities[x][y];
 
 						uint32_t& local_iter = leaf_iterators[region.Index(x, y)];
-						if (local_iter >= kMaxElementsPerLeaf) continue;
+						if (local_iter >= leaf.count) continue;
 
 						const Element* local_id = &leaf.data[local_iter];
-						if (!::IsValid(*local_id)) continue;
-
 						if ((*local_id < lowed_bound) || (*local_id == lowed_bound) || (*local_id == previous_id))
 						{
 							local_iter++;
-							if (local_iter >= kMaxElementsPerLeaf) continue;
+							if (local_iter >= leaf.count) continue;
 							local_id = &leaf.data[local_iter];
-							if (!::IsValid(*local_id)) continue;
 						}
 						assert(previous_id < *local_id);
 						if ((nullptr == min_id) || (*local_id < *min_id))
@@ -218,4 +536,107 @@ struct QuadTree
 		void					operator++(int) { operator++(); }
 		const Element&	operator*()		const { assert(IsValid()); return Get(it); }
 	};
+};
+
+// Rebuilt from scratch every frame by a counting sort, instead of incremental Add/Remove.
+// Count (per entity chunk) -> Prefix (per range of columns) -> Scatter (per entity chunk). Phases of one kind may run in parallel.
+// Chunks must cover ascending id ranges and visit elements in ascending order, so the leaves stay sorted.
+// Scatter must see the same regions as Count. Readers use Front() (the previous build) until Swap() at the frame sync point.
+// Elements that do not fit into a full leaf are left out of that leaf, and counted (see Dropped).
+template<typename Element, uint32_t kMaxChunks = 8, uint32_t kMaxElementsPerLeaf = (kQuadTreeCacheLineSize - sizeof(uint16_t)) / sizeof(Element)
+	, uint32_t kResolutionX = 64, uint32_t kResolutionY = 64>
+struct DoubleBufferedQuadTree
+{
+	using Tree = QuadTree<Element, kMaxElementsPerLeaf, kResolutionX, kResolutionY>;
+	using Region = typename Tree::Region;
+	using Counter = uint8_t;
+	static_assert(kMaxElementsPerLeaf < UINT8_MAX, "");
+
+private:
+	Tree buffers[2];
+	uint32_t front_idx = 0;
+	Counter chunk_count[kMaxChunks][kResolutionX][kResolutionY] = {};
+	Counter chunk_cursor[kMaxChunks][kResolutionX][kResolutionY] = {};
+	uint32_t chunk_dropped[kMaxChunks] = {};
+	uint32_t front_dropped = 0;
+
+public:
+	const Tree& Front() const { return buffers[front_idx]; }
+
+	// Number of (element, leaf) entries left out of Front(), because the leaf was full.
+	uint32_t Dropped() const { return front_dropped; }
+
+	void Swap()
+	{
+		front_idx ^= 1;
+		front_dropped = 0;
+		for (uint32_t& dropped : chunk_dropped)
+		{
+			front_dropped += dropped;
+			dropped = 0;
+		}
+	}
+
+	void Count(uint32_t chunk_idx, const Region region)
+	{
+		assert(chunk_idx < kMaxChunks);
+		assert(region.IsValid());
+		for (uint32_t x = region.min_x; x < region.max_x; x++)
+		{
+			for (uint32_t y = region.min_y; y < region.max_y; y++)
+			{
+				Counter& count = chunk_count[chunk_idx][x][y];
+				if (count < kMaxElementsPerLeaf)
+				{
+					count++;
+				}
+			}
+		}
+	}
+
+	void Prefix(uint32_t part_idx, uint32_t part_num)
+	{
+		Tree& back = buffers[front_idx ^ 1];
+		const Region columns = Region::Columns(part_idx, part_num);
+		for (uint32_t x = columns.min_x; x < columns.max_x; x++)
+		{
+			uint64_t column_occupied = 0;
+			for (uint32_t y = 0; y < kResolutionY; y++)
+			{
+				uint32_t sum = 0;
+				for (uint32_t chunk_idx = 0; chunk_idx < kMaxChunks; chunk_idx++)
+				{
+					chunk_cursor[chunk_idx][x][y] = static_cast<Counter>(std::min(sum, kMaxElementsPerLeaf));
+					sum += chunk_count[chunk_idx][x][y];
+					chunk_count[chunk_idx][x][y] = 0;
+				}
+				const uint32_t new_size = std::min(sum, kMaxElementsPerLeaf);
+				back.entities[x][y].count = static_cast<uint16_t>(new_size);
+				column_occupied |= uint64_t(new_size ? 1 : 0) << y;
+			}
+			back.occupied[x] = column_occupied;
+		}
+	}
+
+	void Scatter(uint32_t chunk_idx, const Element id, const Region region)
+	{
+		assert(chunk_idx < kMaxChunks);
+		assert(region.IsValid());
+		Tree& back = buffers[front_idx ^ 1];
+		for (uint32_t x = region.min_x; x < region.max_x; x++)
+		{
+			for (uint32_t y = region.min_y; y < region.max_y; y++)
+			{
+				Counter& cursor = chunk_cursor[chunk_idx][x][y];
+				if (cursor < kMaxElementsPerLeaf)
+				{
+					back.entities[x][y].data[cursor++] = id;
+				}
+				else
+				{
+					chunk_dropped[chunk_idx]++;
+				}
+			}
+		}
+	}
 };
\ No newline at end of file
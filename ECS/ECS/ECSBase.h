@@ -4,6 +4,7 @@
 #include<type_traits>
 #include<functional>
 #include<chrono>
+#include<atomic>
 #include "bitset2\bitset2.hpp"
 
 #define IMPLEMENT_COMPONENT(COMP) COMP::Container ECS::Component<COMP::kComponentTypeIdx, COMP::Container>::__container; \
@@ -15,7 +16,7 @@ namespace ECS
 {
 	// >>CONFIG
 	static const constexpr uint32_t kMaxEntityNum = 1024;
-	static const constexpr uint32_t kActuallyImplementedComponents = 12;
+	static const constexpr uint32_t kActuallyImplementedComponents = 13;
 	static const constexpr uint32_t kMaxConcurrentWorkerThreads = 2;
 	static const constexpr uint32_t kMaxExecutionNode = 64;
 	static const constexpr uint32_t kMaxTagsNum = 8;
@@ -24,6 +25,12 @@ namespace ECS
 	static const constexpr uint32_t kMaxComponentTypeNum = kActuallyImplementedComponents;
 	static_assert(kActuallyImplementedComponents <= kMaxComponentTypeNum, "too many component types");
 
+	static const constexpr uint32_t kCacheLineSize = 64;
+
+	// Slot 0 is the main thread, 1 + worker index are the ECS workers. Other threads have no slot.
+	static const constexpr uint32_t kMaxThreadSlots = kMaxConcurrentWorkerThreads + 1;
+	static const constexpr uint32_t kNoThreadSlot = UINT32_MAX;
+
 	struct Tag
 	{
 		using TagId = uint8_t;
@@ -86,6 +93,12 @@ namespace ECS
 		}
 	};
 
+	struct EntityPair
+	{
+		EntityId a;
+		EntityId b;
+	};
+
 	struct EntityHandle
 	{
 		using TGeneration = int16_t;
@@ -142,12 +155,96 @@ namespace ECS
 		return Bitset2::zip_fold_and(sub_set, super_set, [](T sub, T super) { return (sub & ~super) == 0; });
 	}
 
+	using TagSet = Bitset2::bitset2<kMaxTagsNum>;
+
+	// Entities with all the tags of 'all' and none of 'none'. An entity can have many tags.
+	// E.g. TagQuery{ ETeam::Red }.And(EState::Alive).Not(EState::Stunned). A Tag converts to the query of the single tag.
+	struct TagQuery
+	{
+		TagSet all;
+		TagSet none;
+
+		constexpr TagQuery() = default;
+		TagQuery(Tag tag)
+		{
+			if (Tag::kNoTagValue != tag.Index())
+			{
+				all.set(tag.Index(), true);
+			}
+		}
+
+		TagQuery And(Tag tag) const
+		{
+			assert(Tag::kNoTagValue != tag.Index());
+			TagQuery result = *this;
+			result.all.set(tag.Index(), true);
+			return result;
+		}
+
+		TagQuery Not(Tag tag) const
+		{
+			assert(Tag::kNoTagValue != tag.Index());
+			TagQuery result = *this;
+			result.none.set(tag.Index(), true);
+			return result;
+		}
+
+		constexpr bool IsAny() const
+		{
+			return all.none() && none.none();
+		}
+
+		constexpr bool Match(const TagSet& entity_tags) const
+		{
+			return IsSubSetOf(all, entity_tags) && !AnyCommonBit(none, entity_tags);
+		}
+
+		// False, when no entity can match both queries.
+		constexpr static bool Overlap(const TagQuery& a, const TagQuery& b)
+		{
+			return !AnyCommonBit(a.all, b.none) && !AnyCommonBit(a.none, b.all);
+		}
+	};
+
 	namespace Details
 	{
 		using TCacheIter = uint32_t;
 
 		using ComponentIdxSet = Bitset2::bitset2<kMaxComponentTypeNum>;
 
+		inline uint32_t& ThreadSlot_Mutable()
+		{
+			thread_local uint32_t slot = kNoThreadSlot;
+			return slot;
+		}
+
+		// Every run of an execution node takes a new version, and so does every change made outside a task.
+		inline std::atomic_uint32_t& ChangeVersionCounter_Mutable()
+		{
+			static std::atomic_uint32_t version = 0;
+			return version;
+		}
+
+		inline uint32_t NewChangeVersion()
+		{
+			return ChangeVersionCounter_Mutable().fetch_add(1, std::memory_order_relaxed) + 1;
+		}
+
+		// The version of the node run, that the thread executes. Zero outside a task.
+		inline uint32_t& TaskChangeVersion_Mutable()
+		{
+			thread_local uint32_t version = 0;
+			return version;
+		}
+
+		struct EntityRange
+		{
+			EntityId::TIndex begin = 0;
+			EntityId::TIndex end = kMaxEntityNum;
+
+			constexpr bool Contains(EntityId::TIndex id) const { return (id >= begin) && (id < end); }
+		};
+
 		template<int T, bool TIsEmpty> struct AnyComponentBase
 		{
 			static const constexpr uint32_t kComponentTypeIdx = T; //use  boost::hana::type_c ?
@@ -173,6 +270,18 @@ namespace ECS
 		{
 			constexpr static const bool kUseCachedIter = TUseCachedIter;
 			constexpr static const bool kUseAsFilter = TUseCachedIter;
+
+			// Stamped on mutable access, read by Changed<> filters. Chunks of a job may stamp the same entity, so the stamps are atomic.
+			void MarkChanged(EntityId id)
+			{
+				const uint32_t task_version = TaskChangeVersion_Mutable();
+				change_versions[id].store(task_version ? task_version : NewChangeVersion(), std::memory_order_relaxed);
+			}
+
+			uint32_t GetChangeVersion(EntityId id) const { return change_versions[id].load(std::memory_order_relaxed); }
+
+		private:
+			std::atomic_uint32_t change_versions[kMaxEntityNum] = {};
 		};
 
 		template<typename THead, typename... TTail>
@@ -241,8 +350,17 @@ namespace ECS
 
 		template<class TComp, int TIndex> struct Unbox<TComp&, TIndex>
 		{
+			static void MarkIfMutable(EntityId id)
+			{
+				if constexpr (!std::is_const_v<TComp>)
+				{
+					RemoveDecorators<TComp>::type::GetContainer().MarkChanged(id);
+				}
+			}
+
 			template<typename TArr> static TComp& Get(EntityId id, TArr& arr, const ComponentIdxSet&)
 			{
+				MarkIfMutable(id);
 				if constexpr(RemoveDecorators<TComp>::type::Container::kUseCachedIter)
 				{
 					return RemoveDecorators<TComp>::type::GetContainer().GetChecked(id, arr[TIndex]);
@@ -255,6 +373,7 @@ namespace ECS
 			{
 				if constexpr (std::is_same_v<RemoveDecorators<TComp>::type, TKnownComp>)
 				{
+					MarkIfMutable(id);
 					return known_comp;
 				}
 				return Get<TArr>(id, arr, dummy);
@@ -321,6 +440,7 @@ namespace ECS
 		{
 			static TComp& Get(EntityId id, const ComponentIdxSet&)
 			{
+				Unbox<TComp&, 0>::MarkIfMutable(id);
 				return RemoveDecorators<TComp>::type::GetContainer().GetChecked(id);
 			}
 		};
@@ -330,15 +450,21 @@ namespace ECS
 			static TDComp* Get(EntityId id, const ComponentIdxSet& entity_components)
 			{
 				using TComp = typename RemoveDecorators<TDComp>::type;
-				return entity_components.test(TComp::kComponentTypeIdx)
-					? &TComp::GetContainer().GetChecked(id)
-					: nullptr;
+				if (!entity_components.test(TComp::kComponentTypeIdx))
+					return nullptr;
+				Unbox<TDComp&, 0>::MarkIfMutable(id);
+				return &TComp::GetContainer().GetChecked(id);
 			}
 		};
 	}
 
 	template<int T> struct EmptyComponent : public Details::AnyComponentBase<T, true> {};
 
+	inline uint32_t CurrentThreadSlot()
+	{
+		return Details::ThreadSlot_Mutable();
+	}
+
 	template<int T, typename TContainer, int TInitialReserveHint = (kMaxEntityNum / 8)> struct Component : public Details::ComponentBase<T>
 	{
 		using Container = TContainer;
@@ -23,6 +23,10 @@ namespace ECS
 		void Remove(EntityId id) { components[id].Reset(); }
 
 		TComponent& GetChecked(EntityId id) { return components[id]; }
+
+		// Indexed by EntityId, for batched kernels. Entries of entities without the component hold default values.
+		// Writes through it are not stamped, call MarkChanged for the written entities to make them visible to Changed<> filters.
+		TComponent* GetData() { return components; }
 	};
 
 	template<typename TComponent, bool TUseBinarySearch> struct SortedComponentContainer : public Details::BaseComponentContainer<true, true>
@@ -102,6 +106,9 @@ namespace ECS
 		}
 
 		auto& GetCollection() { return components; }
+
+		// The first element with id not less than the given one.
+		auto LowerBound(EntityId::TIndex id) { return DesiredPositionSearch(id); }
 	};
 
 	template<typename TComponent> struct SparseComponentContainer : public Details::BaseComponentContainer<false, true>
@@ -128,6 +135,9 @@ namespace ECS
 		TComponent& GetChecked(EntityId id) { return components.at(id.index); }
 
 		auto& GetCollection() { return components; }
+
+		// The first element with id not less than the given one.
+		auto LowerBound(EntityId::TIndex id) { return components.lower_bound(id); }
 	};
 
 }
\ No newline at end of file
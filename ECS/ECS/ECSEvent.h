@@ -2,7 +2,12 @@
 
 #include "ECSBase.h"
 #include "ECSStat.h"
+#include "ECSManagerAsync.h"
 #include "concurrentqueue\concurrentqueue.h"
+#include <vector>
+#include <optional>
+#include <memory>
+#include <mutex>
 
 namespace ECS
 {
@@ -46,16 +51,463 @@ namespace ECS
 	};
 	static_assert(sizeof(EventStorage) == 32, "");
 
+	// Bump allocator, freed at once by Reset. Regular blocks are kept for the next frames.
+	class alignas(kCacheLineSize) FrameArena
+	{
+		constexpr static const std::size_t kBlockSize = 64 * 1024;
+		std::vector<std::unique_ptr<uint8_t[]>> blocks;
+		std::vector<std::unique_ptr<uint8_t[]>> oversized_blocks;
+		std::size_t block_idx = 0;
+		std::size_t offset = 0;
+
+		static void* Align(uint8_t* ptr, std::size_t alignment)
+		{
+			const uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+			return reinterpret_cast<void*>((address + alignment - 1) & ~(alignment - 1));
+		}
+
+	public:
+		void* Allocate(std::size_t size, std::size_t alignment)
+		{
+			assert(alignment && !(alignment & (alignment - 1)));
+			if (size + alignment > kBlockSize)
+			{
+				oversized_blocks.emplace_back(new uint8_t[size + alignment]);
+				return Align(oversized_blocks.back().get(), alignment);
+			}
+			while (true)
+			{
+				if (block_idx == blocks.size())
+				{
+					blocks.emplace_back(new uint8_t[kBlockSize]);
+				}
+				uint8_t* const block = blocks[block_idx].get();
+				uint8_t* const result = static_cast<uint8_t*>(Align(block + offset, alignment));
+				if (result + size <= block + kBlockSize)
+				{
+					offset = (result + size) - block;
+					return result;
+				}
+				block_idx++;
+				offset = 0;
+			}
+		}
+
+		void Reset()
+		{
+			block_idx = 0;
+			offset = 0;
+			oversized_blocks.clear();
+		}
+	};
+
+	// Queued instead of an event, that does not fit into EventStorage. The event itself lives in a FrameArena,
+	// after the function that executes and destroys it, so the ref is only the vptr and one pointer.
+	struct ArenaEventRef : public IEvent
+	{
+		using ExecuteAndDestroyFunc = void(*)(void* header);
+
+		ExecuteAndDestroyFunc* header = nullptr;
+
+		explicit ArenaEventRef(ExecuteAndDestroyFunc* in_header)
+			: header(in_header) {}
+
+		void Execute()
+		{
+			(*header)(header);
+		}
+	};
+	static_assert(sizeof(ArenaEventRef) == 2 * sizeof(void*), "ArenaEventRef is expected to be a vptr and a pointer");
+
+	// Components accessed by an event handler, decorated like the parameters of a system, e.g. EventAccess<const Position, Velocity>.
+	template<typename... TDecoratedComps>
+	struct EventAccess {};
+
+	class IEventChannel
+	{
+	public:
+		using ScheduleFunc = void(*)(ECSManagerAsync&, IEventChannel&, ExecutionNodeId, ExecutionNodeIdSet);
+
+	protected:
+		ScheduleFunc schedule = nullptr; // null for structural channels, that are drained serially on the main thread
+		bool deterministic = false; // drained on the main thread as well, the drain reads the staging of every thread
+
+		static void DrainJob(TaskChunk, void* channel)
+		{
+			static_cast<IEventChannel*>(channel)->Drain();
+		}
+
+		template<typename... TDecoratedComps>
+		static void ScheduleDrain(ECSManagerAsync& ecs, IEventChannel& channel, ExecutionNodeId node_id, ExecutionNodeIdSet requiried_completed_tasks)
+		{
+			ecs.CallAsyncJob<TDecoratedComps...>(&DrainJob, &channel, node_id, 1, requiried_completed_tasks);
+		}
+
+	public:
+		virtual ~IEventChannel() = default;
+		virtual void FlushCurrentThread() = 0;
+		virtual void Drain() = 0;
+
+		bool IsStructural() const { return !schedule; }
+
+		bool IsDeterministic() const { return deterministic; }
+
+		// When no task runs, see EventManager::DrainChannels. Otherwise as a job, see EventManager::DispatchChannels.
+		bool DrainsAtSyncPoint() const { return IsStructural() || IsDeterministic(); }
+
+		void Schedule(ECSManagerAsync& ecs, ExecutionNodeId node_id, ExecutionNodeIdSet requiried_completed_tasks)
+		{
+			assert(schedule);
+			schedule(ecs, *this, node_id, requiried_completed_tasks);
+		}
+	};
+
+	namespace Details
+	{
+		// Stable LSD radix sort by the uint64_t key member. Passes over bytes equal in all keys are skipped.
+		template<typename T>
+		void RadixSortByKey(std::vector<T>& items, std::vector<T>& scratch)
+		{
+			if (items.size() < 2)
+				return;
+			constexpr uint32_t kDigits = sizeof(uint64_t);
+			std::array<std::array<std::size_t, 256>, kDigits> counts = {};
+			for (const T& item : items)
+			{
+				for (uint32_t digit = 0; digit < kDigits; digit++)
+				{
+					counts[digit][(item.key >> (digit * 8)) & 0xFF]++;
+				}
+			}
+			scratch.resize(items.size());
+			for (uint32_t digit = 0; digit < kDigits; digit++)
+			{
+				const uint32_t shift = digit * 8;
+				std::array<std::size_t, 256>& offsets = counts[digit];
+				if (offsets[(items[0].key >> shift) & 0xFF] == items.size())
+					continue;
+				std::size_t offset = 0;
+				for (std::size_t& it : offsets)
+				{
+					const std::size_t count = it;
+					it = offset;
+					offset += count;
+				}
+				for (const T& item : items)
+				{
+					scratch[offsets[(item.key >> shift) & 0xFF]++] = item;
+				}
+				items.swap(scratch);
+			}
+		}
+	}
+
+	// Events of a single type, kept by value in their own queue and passed to the handler in batches.
+	// A single virtual call per channel on drain, instead of one per event.
+	// Threads with a slot (see CurrentThreadSlot) stage pushed events locally, and enqueue them in bulk with their own
+	// producer token, when the batch is full or the task completes (see EventManager::FlushCurrentThread).
+	// In the deterministic mode events stay staged with a key (execution node, entity, task chunk, task sequence),
+	// and the drain radix sorts them, so the handling order does not depend on the thread timing. The drain reads
+	// the staging of all threads, so the channel is drained at the sync point only, even if it has an EventAccess.
+	// Threads without a slot (e.g. the render thread) push under a lock instead.
+	template<typename TEvent, std::size_t kBatchSize = 256>
+	class EventChannel : public IEventChannel
+	{
+		static_assert(std::is_trivially_copyable_v<TEvent>, "is_trivially_copyable_v");
+		static_assert(std::is_default_constructible_v<TEvent>, "is_default_constructible_v");
+	public:
+		using Handler = void(*)(const TEvent* events, std::size_t num);
+
+	private:
+		struct KeyedEvent
+		{
+			uint64_t key = 0;
+			TEvent event;
+		};
+
+		struct alignas(kCacheLineSize) ThreadStaging
+		{
+			std::optional<moodycamel::ProducerToken> token;
+			std::vector<TEvent> events;
+			std::vector<KeyedEvent> keyed_events;
+		};
+
+		moodycamel::ConcurrentQueue<TEvent> queue;
+		ThreadStaging staging[kMaxThreadSlots];
+		std::mutex unslotted_mutex; // deterministic events of threads without a slot
+		std::vector<KeyedEvent> unslotted_keyed_events;
+		uint32_t unslotted_sequence = 0;
+		std::vector<TEvent> batch;
+		std::vector<KeyedEvent> sorted;
+		std::vector<KeyedEvent> sort_scratch;
+		Handler handler = nullptr;
+
+		static uint64_t OrderKey(EntityId order_entity)
+		{
+			const ExecutionNodeId node = ECSManagerAsync::CurrentExecutionNode();
+			const uint64_t node_key = node.IsValid() ? node.GetIndex() : UINT8_MAX; // after the tasks
+			const uint64_t chunk_key = node.IsValid() ? ECSManagerAsync::CurrentChunk().index : 0;
+			const uint64_t sequence = ECSManagerAsync::NextTaskSequence();
+			static_assert(kMaxExecutionNode <= UINT8_MAX, "");
+			assert(sequence < (1 << 24));
+			return (node_key << 56) | (uint64_t(static_cast<EntityId::TIndex>(order_entity)) << 40) | (chunk_key << 24) | (sequence & 0xFFFFFF);
+		}
+
+		void DrainDeterministic()
+		{
+			assert(!ECSManagerAsync::CurrentExecutionNode().IsValid());
+			while (true)
+			{
+				ECSManagerAsync::RestartSequenceOutsideTask(); // keys of the staged events are taken, the sequence fits into 24 bits
+				sorted.clear();
+				for (ThreadStaging& slot_staging : staging)
+				{
+					sorted.insert(sorted.end(), slot_staging.keyed_events.begin(), slot_staging.keyed_events.end());
+					slot_staging.keyed_events.clear();
+				}
+				{
+					std::lock_guard<std::mutex> guard(unslotted_mutex);
+					sorted.insert(sorted.end(), unslotted_keyed_events.begin(), unslotted_keyed_events.end());
+					unslotted_keyed_events.clear();
+					unslotted_sequence = 0;
+				}
+				if (sorted.empty())
+					break;
+				Details::RadixSortByKey(sorted, sort_scratch);
+				for (std::size_t first = 0; first < sorted.size(); first += kBatchSize)
+				{
+					const std::size_t num = std::min(kBatchSize, sorted.size() - first);
+					for (std::size_t idx = 0; idx < num; idx++)
+					{
+						batch[idx] = sorted[first + idx].event;
+					}
+					handler(batch.data(), num);
+				}
+			}
+		}
+
+		void FlushSlot(ThreadStaging& slot_staging)
+		{
+			if (slot_staging.events.empty())
+				return;
+			ScopeDurationLog __sdl(Details::EStatId::PushEvent, EPredefinedStatGroups::InnerLibrary);
+			queue.enqueue_bulk(*slot_staging.token, slot_staging.events.data(), slot_staging.events.size());
+			slot_staging.events.clear();
+		}
+
+	public:
+		EventChannel(Handler in_handler)
+			: queue(kBatchSize, kMaxThreadSlots, kMaxConcurrentWorkerThreads + 1)
+			, batch(kBatchSize)
+			, handler(in_handler)
+		{
+			assert(handler);
+			for (ThreadStaging& slot_staging : staging)
+			{
+				slot_staging.token.emplace(queue);
+				slot_staging.events.reserve(kBatchSize);
+			}
+		}
+
+		// The handler touches only the declared components (and no structural changes), so the channel is drained
+		// as an async job, concurrently with not conflicting tasks and channels.
+		template<typename... TDecoratedComps>
+		EventChannel(Handler in_handler, EventAccess<TDecoratedComps...>)
+			: EventChannel(in_handler)
+		{
+			schedule = &ScheduleDrain<TDecoratedComps...>;
+		}
+
+		// Only when no events are pending.
+		void SetDeterministic(bool in_deterministic)
+		{
+			assert(std::all_of(std::begin(staging), std::end(staging), [](const ThreadStaging& it) { return it.events.empty() && it.keyed_events.empty(); }));
+			assert(unslotted_keyed_events.empty());
+			assert(queue.size_approx() == 0);
+			deterministic = in_deterministic;
+		}
+
+		// The order_entity (e.g. the one the system was called for) is used only in the deterministic mode.
+		void Push(const TEvent& e, EntityId order_entity = {})
+		{
+			const uint32_t slot = CurrentThreadSlot();
+			if (deterministic)
+			{
+				if (kNoThreadSlot == slot)
+				{
+					// The thread runs no task, so its events go after the tasks, in the push order of all such threads.
+					std::lock_guard<std::mutex> guard(unslotted_mutex);
+					assert(unslotted_sequence < (1 << 24));
+					const uint64_t key = (uint64_t(UINT8_MAX) << 56) | (uint64_t(static_cast<EntityId::TIndex>(order_entity)) << 40) | unslotted_sequence++;
+					unslotted_keyed_events.push_back(KeyedEvent{ key, e });
+					return;
+				}
+				staging[slot].keyed_events.push_back(KeyedEvent{ OrderKey(order_entity), e });
+				return;
+			}
+			if (kNoThreadSlot == slot)
+			{
+				ScopeDurationLog __sdl(Details::EStatId::PushEvent, EPredefinedStatGroups::InnerLibrary);
+				queue.enqueue(e);
+				return;
+			}
+			ThreadStaging& slot_staging = staging[slot];
+			slot_staging.events.push_back(e);
+			if (slot_staging.events.size() >= kBatchSize)
+			{
+				FlushSlot(slot_staging);
+			}
+		}
+
+		void PushBulk(const TEvent* events, std::size_t num, EntityId order_entity = {})
+		{
+			if (deterministic)
+			{
+				for (std::size_t idx = 0; idx < num; idx++)
+				{
+					Push(events[idx], order_entity);
+				}
+				return;
+			}
+			const uint32_t slot = CurrentThreadSlot();
+			if (kNoThreadSlot == slot)
+			{
+				ScopeDurationLog __sdl(Details::EStatId::PushEvent, EPredefinedStatGroups::InnerLibrary);
+				queue.enqueue_bulk(events, num);
+				return;
+			}
+			ThreadStaging& slot_staging = staging[slot];
+			FlushSlot(slot_staging);
+			ScopeDurationLog __sdl(Details::EStatId::PushEvent, EPredefinedStatGroups::InnerLibrary);
+			queue.enqueue_bulk(*slot_staging.token, events, num);
+		}
+
+		void FlushCurrentThread() override
+		{
+			const uint32_t slot = CurrentThreadSlot();
+			if (kNoThreadSlot != slot)
+			{
+				FlushSlot(staging[slot]);
+			}
+		}
+
+		// Main thread only when no task runs, or inside the job of a not structural and not deterministic channel.
+		// Events pushed by the handler to the channel are handled in the same drain.
+		void Drain() override
+		{
+			if (deterministic)
+			{
+				DrainDeterministic();
+				return;
+			}
+			FlushCurrentThread();
+			while (true)
+			{
+				std::size_t num = 0;
+				{
+					ScopeDurationLog __sdl(Details::EStatId::PopEvent, EPredefinedStatGroups::InnerLibrary);
+					num = queue.try_dequeue_bulk(batch.data(), batch.size());
+				}
+				if (!num)
+					break;
+				handler(batch.data(), num);
+				FlushCurrentThread();
+			}
+		}
+	};
+
 	class EventManager
 	{
 		moodycamel::ConcurrentQueue<EventStorage> queue;
+		std::optional<moodycamel::ProducerToken> tokens[kMaxThreadSlots];
+		FrameArena arenas[kMaxThreadSlots];
+		std::mutex unslotted_arena_mutex;
+		FrameArena unslotted_arena; // shared by threads without a slot, e.g. the render thread
+		struct RegisteredChannel
+		{
+			IEventChannel* channel = nullptr;
+			ExecutionNodeId node_id;
+		};
+		std::vector<RegisteredChannel> channels;
+
+		// Offset of the event in its arena allocation, after the ArenaEventRef header.
+		template<class TEvent>
+		constexpr static std::size_t ArenaEventOffset()
+		{
+			constexpr std::size_t kAlignment = alignof(TEvent);
+			return (sizeof(ArenaEventRef::ExecuteAndDestroyFunc) + kAlignment - 1) & ~(kAlignment - 1);
+		}
+
+		template<class TEvent>
+		static void ExecuteAndDestroy(void* header)
+		{
+			TEvent* e = reinterpret_cast<TEvent*>(static_cast<uint8_t*>(header) + ArenaEventOffset<TEvent>());
+			e->Execute();
+			e->~TEvent();
+		}
 	public:
-		EventManager() : queue(256, 0, kMaxConcurrentWorkerThreads + 1) {}
+		EventManager() : queue(256, kMaxThreadSlots, kMaxConcurrentWorkerThreads + 1)
+		{
+			for (auto& token : tokens)
+			{
+				token.emplace(queue);
+			}
+		}
+
+		// The channel must outlive the manager use. Not structural channels need an execution node for their job,
+		// that is not dispatched while the channel is deterministic.
+		void RegisterChannel(IEventChannel& channel, ExecutionNodeId node_id = {})
+		{
+			assert(std::none_of(channels.begin(), channels.end(), [&](const RegisteredChannel& it) { return it.channel == &channel; }));
+			assert(channel.IsStructural() != node_id.IsValid());
+			channels.push_back(RegisteredChannel{ &channel, node_id });
+		}
+
+		// To be called by each thread, that pushed events to channels, e.g. as ECSManagerAsync task completed hook.
+		void FlushCurrentThread()
+		{
+			for (const RegisteredChannel& it : channels)
+			{
+				it.channel->FlushCurrentThread();
+			}
+		}
+
+		// Adds a drain job for every channel not drained at the sync point, after the tasks producing its events.
+		// Events pushed to such channel after its job started, are handled in the next frame.
+		void DispatchChannels(ECSManagerAsync& ecs, ExecutionNodeIdSet requiried_completed_tasks = {})
+		{
+			FlushCurrentThread();
+			for (const RegisteredChannel& it : channels)
+			{
+				if (!it.channel->DrainsAtSyncPoint())
+				{
+					it.channel->Schedule(ecs, it.node_id, requiried_completed_tasks);
+				}
+			}
+		}
+
+		// Main thread only, when no task runs. Structural and deterministic channels are drained in the registration order.
+		void DrainChannels()
+		{
+			for (const RegisteredChannel& it : channels)
+			{
+				if (it.channel->DrainsAtSyncPoint())
+				{
+					it.channel->Drain();
+				}
+			}
+		}
 
 		void Push(EventStorage&& e)
 		{
 			ScopeDurationLog __sdl(Details::EStatId::PushEvent, EPredefinedStatGroups::InnerLibrary);
-			queue.enqueue(e);
+			const uint32_t slot = CurrentThreadSlot();
+			if (kNoThreadSlot == slot)
+			{
+				queue.enqueue(e);
+				return;
+			}
+			queue.enqueue(*tokens[slot], e);
 		}
 
 		bool Pop(EventStorage& result)
@@ -63,5 +515,40 @@ namespace ECS
 			ScopeDurationLog __sdl(Details::EStatId::PopEvent, EPredefinedStatGroups::InnerLibrary);
 			return queue.try_dequeue(result);
 		}
+
+		// Memory valid until ResetFrameArena, e.g. for variable size data referenced by an event.
+		void* AllocateFrameMemory(std::size_t size, std::size_t alignment)
+		{
+			const uint32_t slot = CurrentThreadSlot();
+			if (kNoThreadSlot == slot)
+			{
+				std::lock_guard<std::mutex> guard(unslotted_arena_mutex);
+				return unslotted_arena.Allocate(size, alignment);
+			}
+			return arenas[slot].Allocate(size, alignment);
+		}
+
+		// For events of any size, also not trivially destructible. TEvent needs Execute(), but not IEvent.
+		// The event is destroyed right after execution, so all pushed events must be popped before ResetFrameArena.
+		template<class TEvent, typename... Args>
+		void PushLarge(Args&&... args)
+		{
+			using ExecuteAndDestroyFunc = ArenaEventRef::ExecuteAndDestroyFunc;
+			constexpr std::size_t kAlignment = std::max(alignof(TEvent), alignof(ExecuteAndDestroyFunc));
+			uint8_t* allocation = static_cast<uint8_t*>(AllocateFrameMemory(ArenaEventOffset<TEvent>() + sizeof(TEvent), kAlignment));
+			new (allocation + ArenaEventOffset<TEvent>()) TEvent(std::forward<Args>(args)...);
+			ExecuteAndDestroyFunc* header = new (allocation) ExecuteAndDestroyFunc(&ExecuteAndDestroy<TEvent>);
+			Push(EventStorage::Create<ArenaEventRef>(header));
+		}
+
+		// Main thread only, when no task runs and after the events were popped.
+		void ResetFrameArena()
+		{
+			for (FrameArena& arena : arenas)
+			{
+				arena.Reset();
+			}
+			unslotted_arena.Reset();
+		}
 	};
 }
\ No newline at end of file
@@ -1,13 +1,17 @@
 #pragma once
 
 #include "ECSBase.h"
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <vector>
 #include "malloc.h"
 
 namespace ECS
 {
-	template<typename... TComps> struct Filter
+	// Filter terms, e.g. Filter<Position, Without<StaticActorTag>, AnyOf<EnemyCharacterTag, MissileTag>>.
+	// Entities with none of the components.
+	template<typename... TComps> struct Without
 	{
 		constexpr static Details::ComponentIdxSet GetComponents()
 		{
@@ -15,23 +19,182 @@ namespace ECS
 		}
 	};
 
+	// Entities with at least one of the components.
+	template<typename... TComps> struct AnyOf
+	{
+		constexpr static Details::ComponentIdxSet GetComponents()
+		{
+			return Details::FilterBuilder<false, Details::EComponentFilerOptions::BothMutableAndConst>::Build<TComps...>();
+		}
+	};
+
+	// Entities with all of the components, when any of them was accessed mutably after the given change version.
+	// The version is tracked per execution node by CallAsync, a node visits the entities changed since its previous run started.
+	// Changes are stamped with the version of the writing node run, so a node doesn't see its own changes.
+	// Writes through GetData are stamped only by an explicit MarkChanged.
+	template<typename... TComps> struct Changed
+	{
+		static_assert(sizeof...(TComps) > 0, "");
+		static_assert((!TComps::kIsEmpty && ...), "empty components are not tracked");
+
+		constexpr static Details::ComponentIdxSet GetComponents()
+		{
+			return Details::FilterBuilder<false, Details::EComponentFilerOptions::BothMutableAndConst>::Build<TComps...>();
+		}
+
+		static bool ChangedSince(EntityId id, uint32_t version)
+		{
+			return ((TComps::GetContainer().GetChangeVersion(id) > version) || ...);
+		}
+	};
+
+	namespace Details
+	{
+		// Tested against the component bits of an entity, before any component is fetched.
+		struct ComponentFilter
+		{
+			ComponentIdxSet required;
+			ComponentIdxSet excluded;
+			ComponentIdxSet any_of; // ignored when empty
+
+			constexpr ComponentFilter(const ComponentIdxSet& in_required, const ComponentIdxSet& in_excluded = {}, const ComponentIdxSet& in_any_of = {})
+				: required(in_required), excluded(in_excluded), any_of(in_any_of)
+			{}
+
+			constexpr bool Pass(const ComponentIdxSet& components) const
+			{
+				return IsSubSetOf(required, components)
+					&& !AnyCommonBit(excluded, components)
+					&& (any_of.none() || AnyCommonBit(any_of, components));
+			}
+		};
+
+		template<typename T> struct FilterTerm
+		{
+			constexpr static ComponentIdxSet Required() { return RemoveDecorators<T>::type::GetComponentCache(); }
+			constexpr static ComponentIdxSet Excluded() { return {}; }
+			constexpr static ComponentIdxSet AnyOf() { return {}; }
+			constexpr static int kAnyOfTerms = 0;
+			constexpr static ComponentIdxSet Tracked() { return {}; }
+			constexpr static bool kTracksChanges = false;
+			static bool ChangedSince(EntityId, uint32_t) { return true; }
+		};
+
+		template<typename... TComps> struct FilterTerm<ECS::Without<TComps...>>
+		{
+			constexpr static ComponentIdxSet Required() { return {}; }
+			constexpr static ComponentIdxSet Excluded() { return ECS::Without<TComps...>::GetComponents(); }
+			constexpr static ComponentIdxSet AnyOf() { return {}; }
+			constexpr static int kAnyOfTerms = 0;
+			constexpr static ComponentIdxSet Tracked() { return {}; }
+			constexpr static bool kTracksChanges = false;
+			static bool ChangedSince(EntityId, uint32_t) { return true; }
+		};
+
+		template<typename... TComps> struct FilterTerm<ECS::AnyOf<TComps...>>
+		{
+			constexpr static ComponentIdxSet Required() { return {}; }
+			constexpr static ComponentIdxSet Excluded() { return {}; }
+			constexpr static ComponentIdxSet AnyOf() { return ECS::AnyOf<TComps...>::GetComponents(); }
+			constexpr static int kAnyOfTerms = 1;
+			constexpr static ComponentIdxSet Tracked() { return {}; }
+			constexpr static bool kTracksChanges = false;
+			static bool ChangedSince(EntityId, uint32_t) { return true; }
+		};
+
+		template<typename... TComps> struct FilterTerm<ECS::Changed<TComps...>>
+		{
+			constexpr static ComponentIdxSet Required() { return ECS::Changed<TComps...>::GetComponents(); }
+			constexpr static ComponentIdxSet Excluded() { return {}; }
+			constexpr static ComponentIdxSet AnyOf() { return {}; }
+			constexpr static int kAnyOfTerms = 0;
+			constexpr static ComponentIdxSet Tracked() { return ECS::Changed<TComps...>::GetComponents(); }
+			constexpr static bool kTracksChanges = true;
+			static bool ChangedSince(EntityId id, uint32_t version) { return ECS::Changed<TComps...>::ChangedSince(id, version); }
+		};
+	}
+
+	template<typename... TComps> struct Filter
+	{
+		static_assert((Details::FilterTerm<TComps>::kAnyOfTerms + ... + 0) <= 1, "a single AnyOf term is supported");
+
+		constexpr static bool kTracksChanges = (Details::FilterTerm<TComps>::kTracksChanges || ... || false);
+
+		// Required components
+		constexpr static Details::ComponentIdxSet GetComponents()
+		{
+			return (Details::ComponentIdxSet{} | ... | Details::FilterTerm<TComps>::Required());
+		}
+
+		constexpr static Details::ComponentIdxSet GetExcluded()
+		{
+			return (Details::ComponentIdxSet{} | ... | Details::FilterTerm<TComps>::Excluded());
+		}
+
+		constexpr static Details::ComponentIdxSet GetAnyOf()
+		{
+			return (Details::ComponentIdxSet{} | ... | Details::FilterTerm<TComps>::AnyOf());
+		}
+
+		// Components of Changed<> terms, their stamps are read like the components.
+		constexpr static Details::ComponentIdxSet GetTracked()
+		{
+			return (Details::ComponentIdxSet{} | ... | Details::FilterTerm<TComps>::Tracked());
+		}
+
+		// With the components of the system parameters (pointers are optional).
+		template<typename... TDecoratedComps>
+		constexpr static Details::ComponentFilter Build()
+		{
+			constexpr Details::ComponentIdxSet kRequired = GetComponents()
+				| Details::FilterBuilder<true, Details::EComponentFilerOptions::BothMutableAndConst>::Build<TDecoratedComps...>();
+			static_assert(!AnyCommonBit(kRequired, GetExcluded()), "a required component is excluded");
+			return Details::ComponentFilter{ kRequired, GetExcluded(), GetAnyOf() };
+		}
+
+		// Changed<> terms, the entity passed the bit filter.
+		static bool PassChanged(EntityId id, uint32_t changed_since)
+		{
+			return (Details::FilterTerm<TComps>::ChangedSince(id, changed_since) && ... && true);
+		}
+	};
+
+	// Observed component changes, e.g. ecs.RegisterObserver<OnAdd<Position>>(&func).
+	template<typename TComponent> struct OnAdd
+	{
+		using Component = TComponent;
+		constexpr static bool kAdded = true;
+	};
+
+	template<typename TComponent> struct OnRemove
+	{
+		using Component = TComponent;
+		constexpr static bool kAdded = false;
+	};
+
+	// Called with a batch of entities. OnRemove entities may already be removed.
+	using FObserver = std::add_pointer<void(const EntityHandle* entities, std::size_t num)>::type;
+
 	class ECSManager
 	{
 		struct Entity
 		{
 		private:
 			Details::ComponentIdxSet components_cache;
-			Tag tag;
+			TagSet tags;
 			EntityHandle::TGeneration generation = EntityHandle::kNoGeneration;
 		public:
-			constexpr Tag GetTag() const
+			constexpr const TagSet& GetTags() const
 			{
-				return tag;
+				return tags;
 			}
 
-			void SetTag(Tag t)
+			void SetTag(Tag t, bool value)
 			{
-				tag = t;
+				if (Tag::kNoTagValue != t.Index())
+				{
+					tags.set(t.Index(), value);
+				}
 			}
 
 			constexpr bool IsEmpty() const 
@@ -39,14 +202,14 @@ namespace ECS
 				return components_cache.none(); 
 			}
 
-			constexpr bool PassFilter(const Details::ComponentIdxSet& filter) const
+			constexpr bool PassFilter(const Details::ComponentFilter& filter) const
 			{
-				return IsSubSetOf(filter, components_cache);
+				return filter.Pass(components_cache);
 			}
 
-			constexpr bool PassFilter(const Details::ComponentIdxSet& filter, Tag wanted_tag) const
+			constexpr bool PassFilter(const Details::ComponentFilter& filter, const TagQuery& tag_query) const
 			{
-				return Tag::Match(tag, wanted_tag) && IsSubSetOf(filter, components_cache) ;
+				return tag_query.Match(tags) && filter.Pass(components_cache);
 			}
 
 			constexpr bool HasComponent(int ComponentId) const 
@@ -62,7 +225,7 @@ namespace ECS
 			constexpr void Reset() 
 			{ 
 				components_cache.reset();
-				tag = Tag{};
+				tags.reset();
 			}
 
 			template<typename TComponent> constexpr void Set(bool value)
@@ -101,7 +264,7 @@ namespace ECS
 			Entity entities_space[kMaxEntityNum];
 			Bitset2::bitset2<kMaxEntityNum> free_entities;
 			int cached_number = 0;
-			int actual_max_entity_id = -1;
+			int actual_max_entity_id = -1; // the highest used index, inclusive
 		public:
 			EntityContainer()
 			{
@@ -147,7 +310,7 @@ namespace ECS
 					cached_number++;
 					actual_max_entity_id = std::max(actual_max_entity_id, static_cast<int>(first_zero_idx));
 
-					entity.SetTag(tag);
+					entity.SetTag(tag, true);
 					entity.NextGeneration();
 
 					return EntityHandle{ entity.GetGeneration(), EntityId(first_zero_idx) };
@@ -161,7 +324,7 @@ namespace ECS
 				if (actual_max_entity_id == id)
 				{
 					int iter = id - 1;
-					for (;(iter >= 0) && !free_entities.test(iter); iter--) {}
+					for (;(iter >= 0) && free_entities.test(iter); iter--) {}
 					actual_max_entity_id = iter;
 				}
 				entities_space[id].Reset();
@@ -173,9 +336,9 @@ namespace ECS
 				return cached_number; 
 			}
 
-			EntityId GetNext(EntityId id, const Details::ComponentIdxSet& pattern) const
+			EntityId GetNext(EntityId id, const Details::ComponentFilter& pattern) const
 			{
-				for (EntityId::TIndex it = id + 1; (it < actual_max_entity_id); it++)
+				for (EntityId::TIndex it = id + 1; (it <= actual_max_entity_id); it++)
 				{
 					if (!free_entities.test(it) && entities_space[it].PassFilter(pattern))
 					{
@@ -185,64 +348,87 @@ namespace ECS
 				return EntityId();
 			}
 
-			EntityId GetNext(EntityId id, const Details::ComponentIdxSet& pattern, Tag tag) const
+			EntityId GetNext(EntityId id, const Details::ComponentFilter& pattern, const TagQuery& tag_query, EntityId::TIndex end = kMaxEntityNum) const
 			{
-				for (EntityId::TIndex it = id + 1; (it < actual_max_entity_id); it++)
+				const int last = std::min<int>(actual_max_entity_id + 1, end);
+				for (EntityId::TIndex it = id + 1; (it < last); it++)
 				{
-					if (!free_entities.test(it) && entities_space[it].PassFilter(pattern, tag))
+					if (!free_entities.test(it) && entities_space[it].PassFilter(pattern, tag_query))
 					{
 						return EntityId(it);
 					}
 				}
 				return EntityId();
 			}
+
+			EntityId::TIndex GetIdUpperBound() const
+			{
+				return static_cast<EntityId::TIndex>(actual_max_entity_id + 1);
+			}
 		};
 
+		// An entity bitset per tag, so a tag query is evaluated a word at a time.
 		struct TagContainer
 		{
+			using EntitySet = Bitset2::bitset2<kMaxEntityNum>;
 		private:
-			std::array< std::vector<EntityId>, kMaxTagsNum> entity_per_tag;
+			std::array<EntitySet, kMaxTagsNum> entities_per_tag;
 
 		public:
 			void Reset()
 			{
-				for (auto& v : entity_per_tag)
+				for (auto& entity_set : entities_per_tag)
 				{
-					v.clear();
+					entity_set.reset();
 				}
 			}
 
 			void Add(Tag t, EntityId id)
 			{
 				assert(id.IsValidForm());
-				if (t != Tag::Any())
+				if (Tag::kNoTagValue != t.Index())
 				{
-					auto& v = entity_per_tag[t.Index()];
-					auto it_found = std::lower_bound(v.begin(), v.end(), id);
-					if ((it_found == v.end()) || (id != *it_found))
-					{
-						v.insert(it_found, id);
-					}
+					entities_per_tag[t.Index()].set(id, true);
 				}
 			}
 
 			void Remove(Tag t, EntityId id)
 			{
-				if (t != Tag::Any())
+				if (Tag::kNoTagValue != t.Index())
+				{
+					entities_per_tag[t.Index()].set(id, false);
+				}
+			}
+
+			void RemoveAll(const TagSet& tags, EntityId id)
+			{
+				for (uint32_t idx = 0; idx < kMaxTagsNum; idx++)
 				{
-					auto& v = entity_per_tag[t.Index()];
-					auto it_found = std::lower_bound(v.begin(), v.end(), id);
-					if ((it_found != v.end()) && (id == *it_found))
+					if (tags.test(idx))
 					{
-						v.erase(it_found);
+						entities_per_tag[idx].set(id, false);
 					}
 				}
 			}
 
-			const std::vector<EntityId>& Get(Tag tag) const
+			// The query must require a tag.
+			EntitySet Get(const TagQuery& tag_query) const
 			{
-				assert(tag != Tag::Any());
-				return entity_per_tag[tag.Index()];
+				assert(tag_query.all.any());
+				EntitySet result;
+				result.set();
+				for (uint32_t idx = 0; idx < kMaxTagsNum; idx++)
+				{
+					if (tag_query.all.test(idx))
+					{
+						result &= entities_per_tag[idx];
+					}
+					else if (tag_query.none.test(idx))
+					{
+						result.difference(entities_per_tag[idx]);
+					}
+				}
+				return result;
 			}
 		};
 
@@ -265,8 +451,79 @@ namespace ECS
 			}
 		}
 
+		// Changes of observed components are queued, DeliverObservers calls the observers at the sync point.
+		struct ObservedComponent
+		{
+			constexpr static const uint32_t kNotQueued = UINT32_MAX;
+
+			std::vector<FObserver> on_add;
+			std::vector<FObserver> on_remove;
+			std::vector<EntityHandle> added; // a cancelled addition leaves an invalid handle
+			std::vector<EntityHandle> removed;
+			std::vector<uint32_t> added_index; // per entity id, the position of its queued addition
+
+			// Before the additions are delivered, later changes are queued anew.
+			void UnindexAdded()
+			{
+				for (EntityHandle handle : added)
+				{
+					if (handle.IsValidForm())
+					{
+						added_index[handle.id] = kNotQueued;
+					}
+				}
+				added.erase(std::remove_if(added.begin(), added.end(), [](EntityHandle handle) { return !handle.IsValidForm(); }), added.end());
+			}
+		};
+		std::array<ObservedComponent, kMaxComponentTypeNum> observed;
+		Details::ComponentIdxSet observed_components;
+
+		void QueueAdded(uint32_t component_idx, EntityId id)
+		{
+			if (observed_components.test(component_idx))
+			{
+				ObservedComponent& component = observed[component_idx];
+				uint32_t& added_index = component.added_index[id];
+				if (ObservedComponent::kNotQueued != added_index)
+				{
+					// Already queued, the single entry is reused, so the observers see the current handle once.
+					component.added[added_index] = GetHandle(id);
+					return;
+				}
+				added_index = static_cast<uint32_t>(component.added.size());
+				component.added.push_back(GetHandle(id));
+			}
+		}
+
+		void QueueRemoved(uint32_t component_idx, EntityId id)
+		{
+			if (!observed_components.test(component_idx))
+				return;
+			ObservedComponent& component = observed[component_idx];
+			// Added and removed between sync points, the observers don't see it at all.
+			uint32_t& added_index = component.added_index[id];
+			if (ObservedComponent::kNotQueued != added_index)
+			{
+				component.added[added_index] = EntityHandle{};
+				added_index = ObservedComponent::kNotQueued;
+				return;
+			}
+			component.removed.push_back(GetHandle(id));
+		}
+
 		void RemoveEntityInner(EntityId id)
 		{
+			const Details::ComponentIdxSet observed_removed = observed_components & entities.GetChecked(id).GetCache();
+			if (observed_removed.any())
+			{
+				for (uint32_t idx = 0; idx < kMaxComponentTypeNum; idx++)
+				{
+					if (observed_removed.test(idx))
+					{
+						QueueRemoved(idx, id);
+					}
+				}
+			}
 			RecursiveRemoveComponent<kActuallyImplementedComponents - 1>(id, entities.GetChecked(id));
 			entities.RemoveChecked(id);
 		}
@@ -282,6 +539,13 @@ namespace ECS
 					RemoveEntityInner(i);
 				}
 			}
+			for (ObservedComponent& component : observed)
+			{
+				// the observers are not told about the reset
+				component.UnindexAdded();
+				component.added.clear();
+				component.removed.clear();
+			}
 			tags.Reset();
 		}
 		~ECSManager()
@@ -300,7 +564,7 @@ namespace ECS
 			assert(!debug_lock);
 			if (entities.IsHandleValid(entity_handle))
 			{
-				tags.Remove(entities.GetChecked(entity_handle).GetTag(), entity_handle);
+				tags.RemoveAll(entities.GetChecked(entity_handle).GetTags(), entity_handle);
 				RemoveEntityInner(entity_handle.id);
 				return true;
 			}
@@ -314,18 +578,48 @@ namespace ECS
 		{
 			return nullptr != entities.Get(entity_handle);
 		}
+		EntityId::TIndex GetEntityIdUpperBound() const
+		{
+			return entities.GetIdUpperBound();
+		}
 		EntityHandle GetHandle(EntityId id) const
 		{
 			const Entity* ptr = entities.Get(id);
 			return ptr ? EntityHandle{ ptr->GetGeneration(), id } : EntityHandle{};
 		}
 
+		// Tags are structural changes, like components.
+		void AddTag(EntityId id, Tag tag)
+		{
+			assert(!debug_lock);
+			entities.GetChecked(id).SetTag(tag, true);
+			tags.Add(tag, id);
+		}
+		void RemoveTag(EntityId id, Tag tag)
+		{
+			assert(!debug_lock);
+			entities.GetChecked(id).SetTag(tag, false);
+			tags.Remove(tag, id);
+		}
+		bool HasTag(EntityId id, Tag tag) const
+		{
+			const auto entity = entities.Get(id);
+			return entity && (Tag::kNoTagValue != tag.Index()) && entity->GetTags().test(tag.Index());
+		}
+
 		template<typename TComponent> bool HasComponent(EntityId id) const
 		{
 			const auto entity = entities.Get(id);
 			return entity && entity->HasComponent<TComponent>();
 		}
+		// Stamped as changed, see Changed<>.
 		template<typename TComponent> TComponent& GetComponent(EntityId id)
+		{
+			static_assert(!TComponent::kIsEmpty, "cannot get an empty component");
+			TComponent::GetContainer().MarkChanged(id);
+			return TComponent::GetContainer().GetChecked(id);
+		}
+		template<typename TComponent> const TComponent& GetComponent(EntityId id) const
 		{
 			static_assert(!TComponent::kIsEmpty, "cannot get an empty component");
 			return TComponent::GetContainer().GetChecked(id);
@@ -335,6 +629,8 @@ namespace ECS
 			assert(!debug_lock);
 			static_assert(!TComponent::kIsEmpty, "cannot add an empty component");
 			entities.GetChecked(id).Set<TComponent>(true);
+			QueueAdded(TComponent::kComponentTypeIdx, id);
+			TComponent::GetContainer().MarkChanged(id);
 			return TComponent::GetContainer().Add(id);
 		}
 		template<typename TComponent> void AddEmptyComponent(EntityId id)
@@ -342,10 +638,12 @@ namespace ECS
 			assert(!debug_lock);
 			static_assert(TComponent::kIsEmpty, "cannot add an empty component");
 			entities.GetChecked(id).Set<TComponent>(true);
+			QueueAdded(TComponent::kComponentTypeIdx, id);
 		}
 		template<typename TComponent> void RemoveComponent(EntityId id)
 		{
 			assert(!debug_lock);
+			QueueRemoved(TComponent::kComponentTypeIdx, id);
 			entities.GetChecked(id).Set<TComponent>(false);
 			if constexpr(!TComponent::kIsEmpty)
 			{
@@ -353,8 +651,62 @@ namespace ECS
 			}
 		}
 		
+		template<typename TObserved> void RegisterObserver(FObserver func)
+		{
+			assert(!debug_lock);
+			assert(func);
+			constexpr uint32_t kComponentIdx = TObserved::Component::kComponentTypeIdx;
+			ObservedComponent& component = observed[kComponentIdx];
+			(TObserved::kAdded ? component.on_add : component.on_remove).push_back(func);
+			component.added_index.resize(kMaxEntityNum, ObservedComponent::kNotQueued);
+			observed_components.set(kComponentIdx, true);
+		}
+
+		// At the sync point. Per component, the removals are delivered before the additions.
+		// Changes made by the observers are delivered in the next round.
+		void DeliverObservers()
+		{
+			assert(!debug_lock);
+			std::vector<EntityHandle> batch;
+			auto deliver = [&batch](std::vector<EntityHandle>& queued, const std::vector<FObserver>& observers) -> bool
+			{
+				if (queued.empty())
+					return false;
+				batch.clear();
+				batch.swap(queued);
+				for (FObserver func : observers)
+				{
+					func(batch.data(), batch.size());
+				}
+				return true;
+			};
+
+			bool delivered = true;
+			while (delivered)
+			{
+				delivered = false;
+				for (uint32_t idx = 0; idx < kMaxComponentTypeNum; idx++)
+				{
+					if (observed_components.test(idx))
+					{
+						ObservedComponent& component = observed[idx];
+						delivered |= deliver(component.removed, component.on_remove);
+						component.UnindexAdded();
+						delivered |= deliver(component.added, component.on_add);
+					}
+				}
+			}
+		}
+
+		// Stamps of later mutable accesses outside tasks, and of later node runs, are greater than the returned version.
+		uint32_t GetChangeVersion() const
+		{
+			return Details::ChangeVersionCounter_Mutable().load(std::memory_order_relaxed);
+		}
+
+		// changed_since is used by Changed<> filter terms, see GetChangeVersion.
 		template<typename TFilter = typename Filter<>, typename... TDecoratedComps>
-		void CallBlocking(void(*func)(EntityId, TDecoratedComps...), Tag tag)
+		void CallBlocking(void(*func)(EntityId, TDecoratedComps...), TagQuery tag, Details::EntityRange range = {}, uint32_t changed_since = 0)
 		{
 			assert(debug_lock);
 			using namespace Details;
@@ -364,15 +716,19 @@ namespace ECS
 			using IndexOfParam = IndexOfIterParameter<TDecoratedComps...>;
 			constexpr auto kArrSize = NumCachedIter<typename RemoveDecorators<TDecoratedComps>::type...>();
 			std::array<TCacheIter, kArrSize> cached_iters = { 0 };
-			constexpr ComponentIdxSet kFilter = TFilter::GetComponents() | FilterBuilder<true, EComponentFilerOptions::BothMutableAndConst>::Build<TDecoratedComps...>();
+			constexpr ComponentFilter kFilter = TFilter::template Build<TDecoratedComps...>();
 
-			if (tag != Tag::Any())
+			if (tag.all.any())
 			{
-				const auto& v = tags.Get(tag);
-				for (EntityId id : v)
+				const TagContainer::EntitySet tagged = tags.Get(tag);
+				const auto npos = TagContainer::EntitySet::npos;
+				for (auto idx = (range.begin > 0) ? tagged.find_next(range.begin - 1) : tagged.find_first()
+					; (idx != npos) && (idx < range.end)
+					; idx = tagged.find_next(idx))
 				{
+					const EntityId id(static_cast<EntityId::TIndex>(idx));
 					const auto& entity = entities.GetChecked(id);
-					if (entity.PassFilter(kFilter))
+					if (entity.PassFilter(kFilter) && TFilter::PassChanged(id, changed_since))
 					{
 						func(id, Unbox<TDecoratedComps, IndexOfParam::template Get<TDecoratedComps>()>::Get(id, cached_iters, entity.GetCache())...);
 					}
@@ -382,21 +738,28 @@ namespace ECS
 
 			if constexpr (HeadContainer::kUseAsFilter && !std::is_pointer_v<Head>)
 			{
-				for (auto& it : HeadComponent::GetContainer().GetCollection())
+				// A chunk starts at its range, CallAsyncParallel doesn't walk the collection once per chunk.
+				auto& collection = HeadComponent::GetContainer().GetCollection();
+				for (auto it = HeadComponent::GetContainer().LowerBound(range.begin); it != collection.end(); it++)
 				{
-					const EntityId id(it.first);
+					if (it->first >= range.end)
+						break;
+					const EntityId id(it->first);
 					const auto& entity = entities.GetChecked(id);
-					if (entity.PassFilter(kFilter, tag))
+					if (entity.PassFilter(kFilter, tag) && TFilter::PassChanged(id, changed_since))
 					{
-						HeadComponent& head_comp = it.second;
+						HeadComponent& head_comp = it->second;
 						func(id, Unbox<TDecoratedComps, IndexOfParam::template Get<TDecoratedComps>()>::Get(id, cached_iters, entity.GetCache(), head_comp)...);
 					}
 				}
 			}
 			else
 			{
-				for (EntityId id = entities.GetNext({}, kFilter, tag); id.IsValidForm(); id = entities.GetNext(id, kFilter, tag))
+				const EntityId before_range = (range.begin > 0) ? EntityId(range.begin - 1) : EntityId{};
+				for (EntityId id = entities.GetNext(before_range, kFilter, tag, range.end); id.IsValidForm(); id = entities.GetNext(id, kFilter, tag, range.end))
 				{
+					if (!TFilter::PassChanged(id, changed_since))
+						continue;
 					const auto& entity = entities.GetChecked(id);
 					func(id, Unbox<TDecoratedComps, IndexOfParam::template Get<TDecoratedComps>()>::Get(id, cached_iters, entity.GetCache())...);
 				}
@@ -404,14 +767,15 @@ namespace ECS
 		}
 
 		template<typename TFilterA = typename Filter<>, typename TFilterB = typename Filter<>, typename THolder, typename... TDComps1, typename... TDComps2>
-		void CallOverlapBlocking(THolder(*first_pass)(EntityId, TDComps1...), void(*second_pass)(THolder&, EntityId, TDComps2...), Tag tag_a, Tag tag_b)
+		void CallOverlapBlocking(THolder(*first_pass)(EntityId, TDComps1...), void(*second_pass)(THolder&, EntityId, TDComps2...), TagQuery tag_a, TagQuery tag_b)
 		{
+			static_assert(!TFilterA::kTracksChanges && !TFilterB::kTracksChanges, "Changed<> is supported by CallBlocking");
 			std::vector<uint8_t> memory(512, 0); 
 
 			using namespace Details;
 			auto handle_second_pass = [&](THolder& holder) -> void
 			{
-				constexpr ComponentIdxSet kFilter = TFilterB::GetComponents() | FilterBuilder<true, EComponentFilerOptions::BothMutableAndConst>::Build<TDComps2...>();
+				constexpr ComponentFilter kFilter = TFilterB::template Build<TDComps2...>();
 				for (auto iter = holder.GetIter(memory); iter; iter++)
 				{
 					const EntityId id = *iter;
@@ -430,7 +794,7 @@ namespace ECS
 			using IndexOfParam = IndexOfIterParameter<TDComps1...>;
 			constexpr auto kArrSize = NumCachedIter<typename RemoveDecorators<TDComps1>::type...>();
 			std::array<TCacheIter, kArrSize> cached_iters = { 0 };
-			constexpr ComponentIdxSet kFilter = TFilterA::GetComponents() | FilterBuilder<true, EComponentFilerOptions::BothMutableAndConst>::Build<TDComps1...>();
+			constexpr ComponentFilter kFilter = TFilterA::template Build<TDComps1...>();
 			if constexpr (HeadContainer::kUseAsFilter && !std::is_pointer_v<Head>)
 			{
 				for (auto& it : HeadComponent::GetContainer().GetCollection())
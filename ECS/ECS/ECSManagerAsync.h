@@ -9,32 +9,143 @@
 #include <chrono>
 #include <condition_variable>
 #include <atomic>
+#include <algorithm>
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "ECSStat.h"
 
 namespace ECS
 {
+	// Bumped, when a thread helping with tasks may stop waiting: a task finished or a gate opened.
+	struct WakeEpoch
+	{
+		std::atomic_uint32_t value = 0;
+
+		void Bump()
+		{
+			value.fetch_add(1, std::memory_order_release);
+			value.notify_all();
+		}
+	};
+
+	namespace AsyncDetails
+	{
+		inline void CpuRelax()
+		{
+#if defined(_M_X64) || defined(__x86_64__)
+			_mm_pause();
+#else
+			std::this_thread::yield();
+#endif
+		}
+
+		// Spins before the thread sleeps. The spin is doubled after a wait that it ended, and halved otherwise.
+		class AdaptiveSpin
+		{
+			constexpr static const uint32_t kMinSpin = 16;
+			constexpr static const uint32_t kMaxSpin = 4096;
+			std::atomic_uint32_t spin = 256;
+
+		public:
+			template<typename TPredicate>
+			bool Spin(TPredicate predicate)
+			{
+				const uint32_t limit = spin.load(std::memory_order_relaxed);
+				for (uint32_t idx = 0; idx < limit; idx++)
+				{
+					if (predicate())
+					{
+						spin.store(std::min(limit * 2, kMaxSpin), std::memory_order_relaxed);
+						return true;
+					}
+					CpuRelax();
+				}
+				spin.store(std::max(limit / 2, kMinSpin), std::memory_order_relaxed);
+				return false;
+			}
+		};
+	}
+
+	// Auto-reset: every Open lets a single WaitEnterClose through. Opening an open gate does nothing.
 	class ThreadGate
 	{
-		enum class EState { Close, Open };
-		std::atomic<EState> state = EState::Close;
-		std::mutex mutex;
-		std::condition_variable cv;
+		constexpr static const uint32_t kClosed = 0;
+		constexpr static const uint32_t kOpen = 1;
+		std::atomic_uint32_t state = kClosed;
+		AsyncDetails::AdaptiveSpin spin;
+		std::atomic<WakeEpoch*> wake_epoch = nullptr;
 
 	public:
+		// Returns false instead of waiting.
+		bool TryEnterClose()
+		{
+			uint32_t expected = kOpen;
+			return (kOpen == state.load(std::memory_order_relaxed))
+				&& state.compare_exchange_strong(expected, kClosed, std::memory_order_acquire, std::memory_order_relaxed);
+		}
+
+		// The epoch is bumped by every Open, so a thread helping with tasks notices it.
+		void SetWakeEpoch(WakeEpoch* epoch)
+		{
+			wake_epoch.store(epoch, std::memory_order_release);
+		}
+
 		void WaitEnterClose()
 		{
-			std::unique_lock<std::mutex> lk(mutex);
-			cv.wait(lk, [this]() { return EState::Open == state; });
-			state = EState::Close;
+			TraceScope __ts("ThreadGate::WaitEnterClose");
+			if (spin.Spin([this]() { return TryEnterClose(); }))
+				return;
+			while (!TryEnterClose())
+			{
+				state.wait(kClosed, std::memory_order_relaxed);
+			}
 		}
 
 		void Open()
 		{
+			TraceScope __ts("ThreadGate::Open");
+			state.store(kOpen, std::memory_order_release);
+			state.notify_one();
+			if (WakeEpoch* epoch = wake_epoch.load(std::memory_order_acquire))
 			{
-				std::lock_guard<std::mutex> lk(mutex);
-				state = EState::Open;
+				epoch->Bump();
 			}
-			cv.notify_one();
+		}
+	};
+
+	// Manual-reset, for many waiters: all of them pass while it is set.
+	class ThreadEvent
+	{
+		std::atomic_uint32_t set = 0;
+		AsyncDetails::AdaptiveSpin spin;
+
+	public:
+		bool IsSet() const
+		{
+			return 0 != set.load(std::memory_order_acquire);
+		}
+
+		void Wait()
+		{
+			TraceScope __ts("ThreadEvent::Wait");
+			if (spin.Spin([this]() { return IsSet(); }))
+				return;
+			while (!IsSet())
+			{
+				set.wait(0, std::memory_order_relaxed);
+			}
+		}
+
+		void Set()
+		{
+			set.store(1, std::memory_order_release);
+			set.notify_all();
+		}
+
+		void Reset()
+		{
+			set.store(0, std::memory_order_relaxed);
 		}
 	};
 
@@ -68,6 +179,12 @@ namespace ECS
 		}
 	};
 
+	struct TaskChunk
+	{
+		uint16_t index = 0;
+		uint16_t num = 1;
+	};
+
 	namespace AsyncDetails
 	{
 		struct Task;
@@ -77,11 +194,11 @@ namespace ECS
 		{
 			Details::ComponentIdxSet read_only_components;
 			Details::ComponentIdxSet mutable_components;
-			Tag tag;
+			TagQuery tag;
 
 			constexpr bool Conflict(const TaskFilter& other) const
 			{
-				if (Tag::Match(tag, other.tag))
+				if (TagQuery::Overlap(tag, other.tag))
 				{
 					return AnyCommonBit(mutable_components,		other.mutable_components)
 						|| AnyCommonBit(mutable_components,		other.read_only_components)
@@ -101,6 +218,12 @@ namespace ECS
 			ExecutionNodeIdSet required_completed_tasks;
 			ExecutionNodeId execution_id;
 			ThreadGate* optional_notifier = nullptr;
+			Details::EntityRange range;
+			TaskChunk chunk;
+			void* job_context = nullptr;
+			uint32_t changed_since = 0; // the version of the previous run of the node
+			uint32_t change_version = 0; // of this run, taken by its first started chunk
+			bool tracks_changes = false; // Changed<> filter terms
 		};
 
 		template<typename TFilter = typename Filter<>, typename... TDecoratedComps>
@@ -109,7 +232,23 @@ namespace ECS
 			using TFuncPtr = typename std::add_pointer_t<void(EntityId, TDecoratedComps...)>;
 			assert(!!task.per_entity_function);
 			TFuncPtr func = reinterpret_cast<TFuncPtr>(task.per_entity_function);
-			ecs.CallBlocking<TFilter>(func, task.filter.tag);
+			ecs.CallBlocking<TFilter>(func, task.filter.tag, task.range, task.changed_since);
+		}
+
+		inline void CallJob(ECSManager&, Task& task)
+		{
+			using TFuncPtr = std::add_pointer_t<void(TaskChunk)>;
+			assert(!!task.per_entity_function);
+			TFuncPtr func = reinterpret_cast<TFuncPtr>(task.per_entity_function);
+			func(task.chunk);
+		}
+
+		inline void CallJobWithContext(ECSManager&, Task& task)
+		{
+			using TFuncPtr = std::add_pointer_t<void(TaskChunk, void*)>;
+			assert(!!task.per_entity_function);
+			TFuncPtr func = reinterpret_cast<TFuncPtr>(task.per_entity_function);
+			func(task.chunk, task.job_context);
 		}
 		
 		template<typename TFilterA = typename Filter<>, typename TFilterB = typename Filter<>
@@ -126,6 +265,266 @@ namespace ECS
 			ecs.CallOverlapBlocking<TFilterA, TFilterB, THolder>(func_fp, func_sp
 				, task.filter.tag, task.filter_second_pass->tag);
 		}
+
+#if ECS_STAT_ENABLED
+		// The frame timeline of execution nodes: when a node was dispatched, ready (its required nodes completed) and started.
+		// The wait of a ready node is blamed on the conflicting node, that was running when the task was skipped.
+		// Updated under the task mutex. Frames are summed up, Log prints averages and the most expensive edges.
+		class TaskGraphAnalysis
+		{
+			using Ticks = StatTimer::Ticks;
+
+			enum class EEdge : uint8_t { Dependency, Conflict, _Count };
+
+			struct NodeFrame
+			{
+				Ticks dispatched = 0;
+				Ticks first_start = 0;
+				Ticks completed = 0;
+				ExecutionNodeIdSet required;
+				ExecutionNodeId blocked_by; // since the last started chunk
+				Details::ComponentIdxSet blocking_components;
+				// what delayed the first chunk
+				EEdge gate = EEdge::_Count;
+				ExecutionNodeId gate_node;
+				Ticks gate_wait = 0;
+				bool used = false;
+			};
+
+			struct EdgeTotal
+			{
+				Ticks wait = 0;
+				Ticks critical_wait = 0;
+				int64_t critical_frames = 0;
+				Details::ComponentIdxSet components;
+			};
+
+			std::array<NodeFrame, kMaxExecutionNode> nodes;
+			std::vector<EdgeTotal> edges = std::vector<EdgeTotal>(static_cast<std::size_t>(EEdge::_Count) * kMaxExecutionNode * kMaxExecutionNode);
+			std::vector<ExecutionNodeId> last_critical_path;
+			Ticks frame_busy = 0;
+			Ticks frame_find = 0;
+			Ticks frame_worker_wait = 0;
+
+			int64_t frames = 0;
+			Ticks span = 0;
+			Ticks critical_path = 0;
+			Ticks busy = 0;
+			Ticks find = 0;
+			Ticks worker_wait = 0;
+
+			EdgeTotal& Edge(EEdge kind, ExecutionNodeId from, ExecutionNodeId to)
+			{
+				return edges[(static_cast<std::size_t>(kind) * kMaxExecutionNode + from.GetIndex()) * kMaxExecutionNode + to.GetIndex()];
+			}
+
+			static Details::ComponentIdxSet CommonComponents(const TaskFilter& a, const TaskFilter& b)
+			{
+				if (!a.Conflict(b))
+					return {};
+				return (a.mutable_components & (b.mutable_components | b.read_only_components))
+					| (a.read_only_components & b.mutable_components);
+			}
+
+		public:
+			void OnDispatched(const Task& task)
+			{
+				NodeFrame& node = nodes[task.execution_id.GetIndex()];
+				node = NodeFrame{};
+				node.dispatched = StatTimer::Now();
+				node.required = task.required_completed_tasks;
+				node.used = true;
+			}
+
+			// The ready task was skipped, because it conflicts with the running one.
+			void OnBlocked(const Task& task, const Task& running)
+			{
+				NodeFrame& node = nodes[task.execution_id.GetIndex()];
+				node.blocked_by = running.execution_id;
+				node.blocking_components |= CommonComponents(task.filter, running.filter);
+				if (running.filter_second_pass.has_value())
+					node.blocking_components |= CommonComponents(task.filter, *running.filter_second_pass);
+				if (task.filter_second_pass.has_value())
+				{
+					node.blocking_components |= CommonComponents(*task.filter_second_pass, running.filter);
+					if (running.filter_second_pass.has_value())
+						node.blocking_components |= CommonComponents(*task.filter_second_pass, *running.filter_second_pass);
+				}
+			}
+
+			void OnStarted(const Task& task)
+			{
+				const Ticks now = StatTimer::Now();
+				const ExecutionNodeId id = task.execution_id;
+				NodeFrame& node = nodes[id.GetIndex()];
+				Ticks ready = node.dispatched;
+				ExecutionNodeId last_dependency;
+				for (uint16_t idx = 0; idx < kMaxExecutionNode; idx++)
+				{
+					if (node.required.bits.test(idx) && (nodes[idx].completed > ready))
+					{
+						ready = nodes[idx].completed;
+						last_dependency = ExecutionNodeId{ idx };
+					}
+				}
+				const Ticks wait = now - ready;
+				const bool first = (0 == node.first_start);
+				if (first)
+				{
+					node.first_start = now;
+					if (last_dependency.IsValid())
+					{
+						Edge(EEdge::Dependency, last_dependency, id).wait += ready - node.dispatched;
+						node.gate = EEdge::Dependency;
+						node.gate_node = last_dependency;
+						node.gate_wait = ready - node.dispatched;
+					}
+				}
+				if (node.blocked_by.IsValid())
+				{
+					EdgeTotal& edge = Edge(EEdge::Conflict, node.blocked_by, id);
+					edge.wait += wait;
+					edge.components |= node.blocking_components;
+					if (first)
+					{
+						node.gate = EEdge::Conflict;
+						node.gate_node = node.blocked_by;
+						node.gate_wait = wait;
+					}
+				}
+				else
+				{
+					frame_worker_wait += wait;
+				}
+				node.blocked_by = ExecutionNodeId{};
+				node.blocking_components.reset();
+			}
+
+			void OnDone(ExecutionNodeId id, Ticks start, Ticks end, bool node_completed)
+			{
+				frame_busy += end - start;
+				if (node_completed && id.IsValid())
+				{
+					nodes[id.GetIndex()].completed = StatTimer::Now();
+				}
+			}
+
+			void OnFind(Ticks duration)
+			{
+				frame_find += duration;
+			}
+
+			// Walks back from the last completed node, through what delayed the start of every node.
+			// The critical path is the execution of the nodes on the chain, and the waits of every node since its gating node completed.
+			// The gate wait before that overlaps with the execution of the gating node, that is already summed up.
+			void EndFrame()
+			{
+				Ticks first_dispatched = INT64_MAX;
+				Ticks last_completed = 0;
+				ExecutionNodeId last_node;
+				for (uint16_t idx = 0; idx < kMaxExecutionNode; idx++)
+				{
+					const NodeFrame& node = nodes[idx];
+					if (!node.used)
+						continue;
+					first_dispatched = std::min(first_dispatched, node.dispatched);
+					if (node.completed > last_completed)
+					{
+						last_completed = node.completed;
+						last_node = ExecutionNodeId{ idx };
+					}
+				}
+				if (last_node.IsValid())
+				{
+					frames++;
+					span += last_completed - first_dispatched;
+					busy += frame_busy;
+					find += frame_find;
+					worker_wait += frame_worker_wait;
+
+					last_critical_path.clear();
+					ExecutionNodeId current = last_node;
+					while (current.IsValid() && (last_critical_path.size() < kMaxExecutionNode))
+					{
+						last_critical_path.push_back(current);
+						const NodeFrame& node = nodes[current.GetIndex()];
+						if (node.first_start && (node.completed > node.first_start))
+						{
+							critical_path += node.completed - node.first_start;
+						}
+						if (!node.gate_node.IsValid() || (EEdge::_Count == node.gate))
+							break;
+						const Ticks gate_completed = nodes[node.gate_node.GetIndex()].completed;
+						if (gate_completed && (node.first_start > gate_completed))
+						{
+							critical_path += node.first_start - gate_completed;
+						}
+						EdgeTotal& edge = Edge(node.gate, node.gate_node, current);
+						edge.critical_wait += node.gate_wait;
+						edge.critical_frames++;
+						current = node.gate_node;
+					}
+				}
+				nodes = {};
+				frame_busy = frame_find = frame_worker_wait = 0;
+			}
+
+			void Reset()
+			{
+				*this = TaskGraphAnalysis{};
+			}
+
+			void Log(uint32_t thread_num, uint32_t max_edges = 8) const
+			{
+				if (!frames)
+					return;
+				const double to_ms = 1.0 / StatTimer::TicksPerMs() / frames;
+				printf_s("Task graph per frame [ms] span: %7.3f critical path: %7.3f busy: %7.3f parallelism: %5.2f / %u idle: %7.3f find task: %7.3f wait for worker: %7.3f\n"
+					, span * to_ms, critical_path * to_ms, busy * to_ms, span ? double(busy) / span : 0.0, thread_num
+					, (int64_t(thread_num) * span - busy) * to_ms, find * to_ms, worker_wait * to_ms);
+
+				printf_s("Critical path (last frame):");
+				for (auto it = last_critical_path.rbegin(); it != last_critical_path.rend(); it++)
+				{
+					printf_s(" %s%s", (it == last_critical_path.rbegin() ? "" : "-> "), Str(*it));
+				}
+				printf_s("\n");
+
+				std::vector<uint32_t> order;
+				for (uint32_t idx = 0; idx < edges.size(); idx++)
+				{
+					if (edges[idx].wait > 0)
+						order.push_back(idx);
+				}
+				std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+				{
+					return (edges[a].critical_wait != edges[b].critical_wait)
+						? (edges[a].critical_wait > edges[b].critical_wait)
+						: (edges[a].wait > edges[b].wait);
+				});
+				for (uint32_t idx = 0; (idx < order.size()) && (idx < max_edges); idx++)
+				{
+					const EdgeTotal& edge = edges[order[idx]];
+					const EEdge kind = static_cast<EEdge>(order[idx] / (kMaxExecutionNode * kMaxExecutionNode));
+					const ExecutionNodeId from{ static_cast<uint16_t>(order[idx] / kMaxExecutionNode % kMaxExecutionNode) };
+					const ExecutionNodeId to{ static_cast<uint16_t>(order[idx] % kMaxExecutionNode) };
+					printf_s("Edge %-10s %-28s -> %-28s wait: %7.3f on critical path: %7.3f (%5.1f%% frames)"
+						, (EEdge::Conflict == kind ? "conflict" : "dependency"), Str(from), Str(to)
+						, edge.wait * to_ms, edge.critical_wait * to_ms, 100.0 * edge.critical_frames / frames);
+					if (EEdge::Conflict == kind)
+					{
+						printf_s(" components:");
+						for (uint32_t comp = 0; comp < kMaxComponentTypeNum; comp++)
+						{
+							if (edge.components.test(comp))
+								printf_s(" %u", comp);
+						}
+					}
+					printf_s("\n");
+				}
+			}
+		};
+#endif // ECS_STAT_ENABLED
 	}
 
 	class ECSManagerAsync : public ECSManager
@@ -159,27 +558,51 @@ namespace ECS
 			static bool TryExecuteTask(std::optional<AsyncDetails::Task>& task, ECSManagerAsync& owner, int worker_idx)
 			{
 				(void)worker_idx;
+#if ECS_STAT_ENABLED
+				const StatTimer::Ticks find_start = StatTimer::Now();
+#endif
 				{
 					std::lock_guard<std::mutex> guard(owner.mutex);
 					task = owner.FindTaskToExecute_Unguarded();
+#if ECS_STAT_ENABLED
+					owner.analysis.OnFind(StatTimer::Now() - find_start);
+#endif
 				}
 
 				if (task.has_value())
 				{
 					LOG("ECS worker %d found '%s'", worker_idx, Str(task->execution_id));
+#if ECS_STAT_ENABLED
+					const StatTimer::Ticks task_start = StatTimer::Now();
+#endif
 					{
 						ScopeDurationLog __sdl(task->execution_id);
+						CurrentTaskContext_Mutable() = TaskContext{ task->execution_id, task->chunk, 0 };
+						Details::TaskChangeVersion_Mutable() = task->change_version;
 						task->func(owner, *task);
 					}
+					if (owner.task_completed_hook)
+					{
+						owner.task_completed_hook();
+					}
+#if ECS_STAT_ENABLED
+					const StatTimer::Ticks task_end = StatTimer::Now();
+#endif
+					CurrentTaskContext_Mutable() = TaskContext{};
+					Details::TaskChangeVersion_Mutable() = 0;
 					LOG("ECS worker %d done '%s'", worker_idx, Str(task->execution_id));
 					auto optional_notifier = task->optional_notifier;
 					const bool valid_execution_node = task->execution_id.IsValid();
+					bool node_completed = false;
 					{
 						std::lock_guard<std::mutex> guard(owner.mutex);
-						owner.completed_tasks.Add(task->execution_id);
+						node_completed = owner.CompleteChunk_Unguarded(task->execution_id);
+#if ECS_STAT_ENABLED
+						owner.analysis.OnDone(task->execution_id, task_start, task_end, node_completed);
+#endif
 						task = {};
 					}
-					if (optional_notifier)
+					if (optional_notifier && node_completed)
 					{
 						optional_notifier->Open();
 					}
@@ -187,6 +610,8 @@ namespace ECS
 					{
 						owner.new_task_cv.notify_all();
 					}
+					owner.outstanding_tasks.fetch_sub(1, std::memory_order_release);
+					owner.wake_epoch.Bump();
 					return true;
 				}
 				return false;
@@ -194,6 +619,7 @@ namespace ECS
 
 			void Loop()
 			{
+				Details::ThreadSlot_Mutable() = worker_idx + 1;
 				while (runs)
 				{
 					const bool bExecuted = TryExecuteTask(task, owner, worker_idx);
@@ -218,8 +644,84 @@ namespace ECS
 		std::mutex new_task_mutex;
 
 		std::optional<AsyncDetails::Task> main_thread_task;
+		void(*task_completed_hook)() = nullptr;
 
 		ExecutionNodeIdSet completed_tasks;
+		std::array<uint16_t, kMaxExecutionNode> remaining_chunks = {};
+		std::array<uint32_t, kMaxExecutionNode> node_change_versions = {}; // of the latest started run, for Changed<> filters
+		std::array<uint32_t, kMaxExecutionNode> run_change_versions = {}; // of the dispatched run, zero until its first chunk starts
+		std::atomic_uint32_t outstanding_tasks = 0; // added and not finished chunks, read without the mutex
+		WakeEpoch wake_epoch;
+#if ECS_STAT_ENABLED
+		AsyncDetails::TaskGraphAnalysis analysis;
+#endif
+
+		struct TaskContext
+		{
+			ExecutionNodeId node;
+			TaskChunk chunk;
+			uint32_t sequence = 0;
+		};
+
+		static TaskContext& CurrentTaskContext_Mutable()
+		{
+			thread_local TaskContext context;
+			return context;
+		}
+
+		bool CompleteChunk_Unguarded(ExecutionNodeId id)
+		{
+			if (!id.IsValid())
+				return true;
+			uint16_t& remaining = remaining_chunks[id.GetIndex()];
+			assert(remaining > 0);
+			remaining--;
+			if (remaining > 0)
+				return false;
+			completed_tasks.Add(id);
+			return true;
+		}
+
+		// Chunks split the used entity id range evenly, the last one is open-ended.
+		void AddPendingTask(const AsyncDetails::Task& task, uint16_t chunk_num)
+		{
+			assert(task.execution_id.IsValid());
+			assert(chunk_num > 0);
+			const uint32_t id_upper_bound = GetEntityIdUpperBound();
+			{
+				std::lock_guard<std::mutex> guard(mutex);
+				uint16_t& remaining = remaining_chunks[task.execution_id.GetIndex()];
+				assert(0 == remaining);
+				remaining = chunk_num;
+				run_change_versions[task.execution_id.GetIndex()] = 0;
+				outstanding_tasks.fetch_add(chunk_num, std::memory_order_relaxed);
+#if ECS_STAT_ENABLED
+				analysis.OnDispatched(task);
+#endif
+				for (uint16_t idx = 0; idx < chunk_num; idx++)
+				{
+					AsyncDetails::Task chunk_task = task;
+					chunk_task.chunk = TaskChunk{ idx, chunk_num };
+					chunk_task.changed_since = node_change_versions[task.execution_id.GetIndex()]; // zero at the first dispatch, so all entities are visited
+					if (chunk_num > 1)
+					{
+						chunk_task.range.begin = static_cast<EntityId::TIndex>(idx * id_upper_bound / chunk_num);
+						chunk_task.range.end = (idx + 1 == chunk_num)
+							? static_cast<EntityId::TIndex>(kMaxEntityNum)
+							: static_cast<EntityId::TIndex>((idx + 1) * id_upper_bound / chunk_num);
+					}
+					pending_tasks.push_back(std::move(chunk_task));
+				}
+			}
+			if (chunk_num > 1)
+			{
+				new_task_cv.notify_all();
+			}
+			else
+			{
+				new_task_cv.notify_one();
+			}
+		}
 
 		std::optional<AsyncDetails::Task> FindTaskToExecute_Unguarded()
 		{
@@ -229,6 +731,10 @@ namespace ECS
 			
 			auto tasks_conflict = [](const AsyncDetails::Task& a, const AsyncDetails::Task& b) -> bool
 			{
+				// Chunks of a single node work on disjoint entities.
+				if (a.execution_id.GetIndex() == b.execution_id.GetIndex())
+					return false;
+
 				if (a.filter.Conflict(b.filter))
 					return true;
 
@@ -247,17 +753,29 @@ namespace ECS
 				return false;
 			};
 
-			auto conflict_with_other_threads = [&](const AsyncDetails::Task& pending_task) -> bool
+			auto conflict_with_other_threads = [&](const AsyncDetails::Task& pending_task) -> const AsyncDetails::Task*
 			{
 				for (auto& t : wt)
 				{
 					const AsyncDetails::Task* task = t.GetTask_Unsafe();
 					if (task && tasks_conflict(pending_task, *task))
-						return true;
+						return task;
+				}
+				return (main_thread_task.has_value() && tasks_conflict(pending_task, *main_thread_task))
+					? &(*main_thread_task)
+					: nullptr;
+			};
+
+			// All chunks of a node share its change version. A Changed<> reader between them would see the version,
+			// but not the stamps of the later chunks, so it waits for the node to complete.
+			auto conflict_with_started_node = [&](const AsyncDetails::Task& pending_task) -> const AsyncDetails::Task*
+			{
+				for (const AsyncDetails::Task& other : pending_tasks)
+				{
+					if (run_change_versions[other.execution_id.GetIndex()] && tasks_conflict(pending_task, other))
+						return &other;
 				}
-				return main_thread_task.has_value()
-					? tasks_conflict(pending_task, *main_thread_task)
-					: false;
+				return nullptr;
 			};
 
 			for (auto it = pending_tasks.begin(); it != pending_tasks.end(); it++)
@@ -265,11 +783,37 @@ namespace ECS
 				if (!IsSubSetOf(it->required_completed_tasks.bits, completed_tasks.bits))
 					continue;
 
-				if (conflict_with_other_threads(*it))
+				if (const AsyncDetails::Task* running = conflict_with_other_threads(*it))
+				{
+#if ECS_STAT_ENABLED
+					analysis.OnBlocked(*it, *running);
+#endif
+					(void)running;
 					continue;
+				}
+
+				if (const AsyncDetails::Task* started = it->tracks_changes ? conflict_with_started_node(*it) : nullptr)
+				{
+#if ECS_STAT_ENABLED
+					analysis.OnBlocked(*it, *started);
+#endif
+					(void)started;
+					continue;
+				}
 
 				assert(!completed_tasks.Test(it->execution_id));
+#if ECS_STAT_ENABLED
+				analysis.OnStarted(*it);
+#endif
 				std::optional<AsyncDetails::Task> result(std::move(*it));
+				uint32_t& run_version = run_change_versions[result->execution_id.GetIndex()];
+				if (!run_version)
+				{
+					// Changes of the run are stamped with it, the next run of the node visits changes after it.
+					run_version = Details::NewChangeVersion();
+					node_change_versions[result->execution_id.GetIndex()] = run_version;
+				}
+				result->change_version = run_version;
 				const auto remaining_size = pending_tasks.size();
 				pending_tasks.erase(it);
 				assert((remaining_size - 1) == pending_tasks.size());
@@ -289,8 +833,10 @@ namespace ECS
 			: ECSManagerAsync(std::make_index_sequence<kMaxConcurrentWorkerThreads>{})
 		{}
 
+		// Must be called from the main thread.
 		void StartThreads() 
 		{
+			Details::ThreadSlot_Mutable() = 0;
 			for (auto& t : wt)
 			{
 				assert(!t.IsRunning());
@@ -341,46 +887,212 @@ namespace ECS
 			while(!bSingleJob);
 			return result;
 		}
+		// Executes tasks (chunks of parallel tasks included) on the calling thread until the predicate is true.
+		// Sleeps when no task can start, until a task finishes or a gate with the epoch of this manager opens.
+		// Must be called from the main thread.
+		template<typename TPredicate>
+		void HelpUntil(TPredicate predicate)
+		{
+			assert(!main_thread_task.has_value());
+			while (true)
+			{
+				const uint32_t epoch = wake_epoch.value.load(std::memory_order_acquire);
+				if (predicate())
+					break;
+				if (WorkerThread::TryExecuteTask(main_thread_task, *this, -1))
+					continue;
+				wake_epoch.value.wait(epoch, std::memory_order_acquire);
+			}
+		}
+
+		void HelpUntilEnterClose(ThreadGate& gate)
+		{
+			gate.SetWakeEpoch(&wake_epoch);
+			HelpUntil([&gate]() { return gate.TryEnterClose(); });
+		}
+
+		// Wakes the thread sleeping in HelpUntil, e.g. after its predicate changed outside of tasks.
+		void Wake()
+		{
+			wake_epoch.Bump();
+		}
+
+		// Returns when every added task is finished.
+		void WaitForAllTasks()
+		{
+			HelpUntil([this]() { return 0 == outstanding_tasks.load(std::memory_order_acquire); });
+		}
+
 		void ResetCompletedTasks()
 		{
 			std::lock_guard<std::mutex> guard(mutex);
 			assert(pending_tasks.empty());
+			assert(std::all_of(remaining_chunks.begin(), remaining_chunks.end(), [](uint16_t r) { return 0 == r; }));
 			completed_tasks.bits.reset();
+#if ECS_STAT_ENABLED
+			analysis.EndFrame();
+#endif
+		}
+
+#if ECS_STAT_ENABLED
+		// Critical path, parallelism and the dependency/conflict edges that cost the most, averaged over the frames since the last reset.
+		void LogTaskGraphAnalysis()
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			analysis.Log(kMaxConcurrentWorkerThreads + 1);
+		}
+
+		void ResetTaskGraphAnalysis()
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			analysis.Reset();
+		}
+#endif
+
+		// Called on the executing thread after each task (chunk), before it is marked as completed.
+		// E.g. to flush thread local buffers. Set it before StartThreads.
+		void SetTaskCompletedHook(void(*hook)())
+		{
+			task_completed_hook = hook;
+		}
+
+		// Valid only inside a task. Chunked systems and jobs use it to address per-chunk data.
+		static const TaskChunk& CurrentChunk()
+		{
+			return CurrentTaskContext_Mutable().chunk;
+		}
+
+		// Invalid outside a task.
+		static ExecutionNodeId CurrentExecutionNode()
+		{
+			return CurrentTaskContext_Mutable().node;
+		}
+
+		// Counter restarted by every task (chunk). Inside a task it is deterministic, unlike the executing thread.
+		static uint32_t NextTaskSequence()
+		{
+			return CurrentTaskContext_Mutable().sequence++;
+		}
+
+		// Outside a task the counter runs until the thread executes a task. Restarted by the drain of the events keyed with it.
+		static void RestartSequenceOutsideTask()
+		{
+			assert(!CurrentExecutionNode().IsValid());
+			CurrentTaskContext_Mutable().sequence = 0;
 		}
 
 		template<typename TFilter = typename Filter<>, typename... TDecoratedComps>
 		void CallAsync(void(*func)(EntityId, TDecoratedComps...)
-			, Tag tag
+			, TagQuery tag
 			, ExecutionNodeId node_id
 			, ExecutionNodeIdSet requiried_completed_tasks = {}
 			, ThreadGate* optional_notifier = nullptr)
 		{
 			assert(node_id.IsValid());
-			constexpr Details::ComponentIdxSet read_only_components = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyConst>::Build<TDecoratedComps...>();
+			constexpr Details::ComponentIdxSet read_only_params = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyConst>::Build<TDecoratedComps...>();
 			constexpr Details::ComponentIdxSet mutable_components = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyMutable>::Build<TDecoratedComps...>();
-			static_assert((read_only_components & mutable_components).none(), "");
+			static_assert((read_only_params & mutable_components).none(), "");
+			// Stamps of the Changed<> components are read, so their writers are conflicting.
+			constexpr Details::ComponentIdxSet read_only_components = (read_only_params | TFilter::GetTracked()) & ~mutable_components;
 
 			AsyncDetails::InnerSyncFunc inner_func = &AsyncDetails::CallGeneric<TFilter, TDecoratedComps...>;
 			void* per_entity_func = func;
-			{
-				std::lock_guard<std::mutex> guard(mutex);
-				pending_tasks.push_back(AsyncDetails::Task{ inner_func
-					, per_entity_func
-					, nullptr
-					, AsyncDetails::TaskFilter{read_only_components, mutable_components, tag}
-					, {}
-					, requiried_completed_tasks
-					, node_id
-					, optional_notifier });
-			}
-			new_task_cv.notify_one();
+			AsyncDetails::Task task{ inner_func
+				, per_entity_func
+				, nullptr
+				, AsyncDetails::TaskFilter{read_only_components, mutable_components, tag}
+				, {}
+				, requiried_completed_tasks
+				, node_id
+				, optional_notifier };
+			task.tracks_changes = TFilter::kTracksChanges;
+			AddPendingTask(task, 1);
+		}
+
+		// The entities are split into chunk_num tasks that may run concurrently.
+		// The function must not touch components of other entities.
+		template<typename TFilter = typename Filter<>, typename... TDecoratedComps>
+		void CallAsyncParallel(void(*func)(EntityId, TDecoratedComps...)
+			, TagQuery tag
+			, ExecutionNodeId node_id
+			, uint16_t chunk_num
+			, ExecutionNodeIdSet requiried_completed_tasks = {}
+			, ThreadGate* optional_notifier = nullptr)
+		{
+			assert(node_id.IsValid());
+			constexpr Details::ComponentIdxSet read_only_params = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyConst>::Build<TDecoratedComps...>();
+			constexpr Details::ComponentIdxSet mutable_components = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyMutable>::Build<TDecoratedComps...>();
+			static_assert((read_only_params & mutable_components).none(), "");
+			// Stamps of the Changed<> components are read, so their writers are conflicting.
+			constexpr Details::ComponentIdxSet read_only_components = (read_only_params | TFilter::GetTracked()) & ~mutable_components;
+
+			AsyncDetails::InnerSyncFunc inner_func = &AsyncDetails::CallGeneric<TFilter, TDecoratedComps...>;
+			void* per_entity_func = func;
+			AsyncDetails::Task task{ inner_func
+				, per_entity_func
+				, nullptr
+				, AsyncDetails::TaskFilter{read_only_components, mutable_components, tag}
+				, {}
+				, requiried_completed_tasks
+				, node_id
+				, optional_notifier };
+			task.tracks_changes = TFilter::kTracksChanges;
+			AddPendingTask(task, chunk_num);
+		}
+
+		// A job doesn't iterate entities. It declares the components it touches as template arguments, e.g. CallAsyncJob<const Position, Velocity>.
+		// Chunks of a job are not checked against each other.
+		template<typename... TDecoratedComps>
+		void CallAsyncJob(void(*func)(TaskChunk)
+			, ExecutionNodeId node_id
+			, uint16_t chunk_num = 1
+			, ExecutionNodeIdSet requiried_completed_tasks = {}
+			, ThreadGate* optional_notifier = nullptr)
+		{
+			assert(node_id.IsValid());
+			constexpr Details::ComponentIdxSet read_only_components = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyConst>::Build<TDecoratedComps...>();
+			constexpr Details::ComponentIdxSet mutable_components = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyMutable>::Build<TDecoratedComps...>();
+			void* job_func = reinterpret_cast<void*>(func);
+			AddPendingTask(AsyncDetails::Task{ &AsyncDetails::CallJob
+				, job_func
+				, nullptr
+				, AsyncDetails::TaskFilter{read_only_components, mutable_components, Tag{}}
+				, {}
+				, requiried_completed_tasks
+				, node_id
+				, optional_notifier }, chunk_num);
+		}
+
+		// Same as above, the context is passed to every chunk.
+		template<typename... TDecoratedComps>
+		void CallAsyncJob(void(*func)(TaskChunk, void*)
+			, void* context
+			, ExecutionNodeId node_id
+			, uint16_t chunk_num = 1
+			, ExecutionNodeIdSet requiried_completed_tasks = {}
+			, ThreadGate* optional_notifier = nullptr)
+		{
+			assert(node_id.IsValid());
+			constexpr Details::ComponentIdxSet read_only_components = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyConst>::Build<TDecoratedComps...>();
+			constexpr Details::ComponentIdxSet mutable_components = Details::FilterBuilder<false, Details::EComponentFilerOptions::OnlyMutable>::Build<TDecoratedComps...>();
+			void* job_func = reinterpret_cast<void*>(func);
+			AsyncDetails::Task task{ &AsyncDetails::CallJobWithContext
+				, job_func
+				, nullptr
+				, AsyncDetails::TaskFilter{read_only_components, mutable_components, Tag{}}
+				, {}
+				, requiried_completed_tasks
+				, node_id
+				, optional_notifier };
+			task.job_context = context;
+			AddPendingTask(task, chunk_num);
 		}
 
 		template<typename TFilterA = typename Filter<>, typename TFilterB = typename Filter<>, typename THolder, typename... TDComps1, typename... TDComps2>
 		void CallAsyncOverlap(THolder(*first_pass)(EntityId, TDComps1...)
 			, void(*second_pass)(THolder&, EntityId, TDComps2...)
-			, Tag tag_a
-			, Tag tag_b
+			, TagQuery tag_a
+			, TagQuery tag_b
 			, ExecutionNodeId node_id
 			, ExecutionNodeIdSet requiried_completed_tasks = {}
 			, ThreadGate* optional_notifier = nullptr)
@@ -392,18 +1104,14 @@ namespace ECS
 			using TFuncPtr_FP = typename std::add_pointer_t<THolder(EntityId, TDComps1...)>;
 			using TFuncPtr_SP = typename std::add_pointer_t<void(THolder&, EntityId, TDComps2...)>;
 			AsyncDetails::InnerSyncFunc inner_func = &AsyncDetails::CallGeneric2<TFilterA, TFilterB, THolder, TFuncPtr_FP, TFuncPtr_SP>;
-			{
-				std::lock_guard<std::mutex> guard(mutex);
-				pending_tasks.push_back(AsyncDetails::Task{ inner_func
-					, first_pass
-					, second_pass
-					, AsyncDetails::TaskFilter{FB_Const::Build<TDComps1...>(), FB_Mut::Build<TDComps1...>(), tag_a}
-					, AsyncDetails::TaskFilter{FB_Const::Build<TDComps2...>(), FB_Mut::Build<TDComps2...>(), tag_b}
-					, requiried_completed_tasks
-					, node_id
-					, optional_notifier });
-			}
-			new_task_cv.notify_one();
+			AddPendingTask(AsyncDetails::Task{ inner_func
+				, first_pass
+				, second_pass
+				, AsyncDetails::TaskFilter{FB_Const::Build<TDComps1...>(), FB_Mut::Build<TDComps1...>(), tag_a}
+				, AsyncDetails::TaskFilter{FB_Const::Build<TDComps2...>(), FB_Mut::Build<TDComps2...>(), tag_b}
+				, requiried_completed_tasks
+				, node_id
+				, optional_notifier }, 1);
 		}
 	};
 }
\ No newline at end of file
@@ -3,6 +3,11 @@
 #include <chrono>
 #include <atomic>
 #include <vector>
+#include <algorithm>
+#include <bit>
+#include <string>
+#include <cstdio>
+#include <thread>
 #include <assert.h>
 #include "ECSBase.h"
 
@@ -14,6 +19,44 @@
 #define ECS_LOG_ENABLED  0
 #endif
 
+// Durations measured with the time stamp counter (assumed invariant), calibrated against the steady clock in LogAll.
+#ifndef ECS_STAT_TSC_TIMER
+#if defined(_M_X64) || defined(__x86_64__)
+#define ECS_STAT_TSC_TIMER 1
+#else
+#define ECS_STAT_TSC_TIMER 0
+#endif
+#endif
+
+#if ECS_STAT_TSC_TIMER
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+// Hardware counters (cycles, instructions, LLC and branch misses) per stat record, Linux perf_event_open only.
+// Elsewhere the counters read zeros and are not logged. Every measured scope reads the counters twice,
+// with rdpmc from user space on x86, otherwise with a group read (a syscall each), so it is off by default.
+#ifndef ECS_STAT_PERF_COUNTERS
+#define ECS_STAT_PERF_COUNTERS 0
+#endif
+
+#if ECS_STAT_PERF_COUNTERS
+#include <array>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#define ECS_STAT_PERF_RDPMC 1
+#endif
+#endif
+#endif
+
 #undef STAT
 namespace ECS
 {
@@ -38,19 +81,185 @@ namespace ECS
 	}
 #if ECS_STAT_ENABLED
 
+	struct StatTimer
+	{
+		using Ticks = int64_t;
+
+		static Ticks Now()
+		{
+#if ECS_STAT_TSC_TIMER
+			return static_cast<Ticks>(__rdtsc());
+#else
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+		}
+
+		// Ticks per millisecond, measured since the first call.
+		static double TicksPerMs()
+		{
+#if ECS_STAT_TSC_TIMER
+			static const Ticks start_ticks = Now();
+			static const auto start_time = std::chrono::steady_clock::now();
+			const Ticks ticks = Now() - start_ticks;
+			const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+			return (ms > 0.0) ? (ticks / ms) : 1.0;
+#else
+			return 1000000.0;
+#endif
+		}
+	};
+
+#if ECS_STAT_PERF_COUNTERS
+	// The counters of the calling thread, opened as one group on the first read.
+	struct PerfCounters
+	{
+		enum ECounter { Cycles, Instructions, LLCMisses, BranchMisses, _Count };
+		using Values = std::array<int64_t, ECounter::_Count>;
+
+	private:
+#ifdef __linux__
+		struct ThreadGroup
+		{
+			int fds[ECounter::_Count] = { -1, -1, -1, -1 };
+#if ECS_STAT_PERF_RDPMC
+			perf_event_mmap_page* pages[ECounter::_Count] = {};
+			std::size_t page_size = 0;
+#endif
+			bool opened = false;
+
+			ThreadGroup()
+			{
+				constexpr uint64_t kConfigs[ECounter::_Count] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS
+					, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+				for (int idx = 0; idx < ECounter::_Count; idx++)
+				{
+					perf_event_attr attr = {};
+					attr.size = sizeof(attr);
+					attr.type = PERF_TYPE_HARDWARE;
+					attr.config = kConfigs[idx];
+					attr.read_format = PERF_FORMAT_GROUP;
+					attr.exclude_kernel = 1;
+					attr.exclude_hv = 1;
+					fds[idx] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, idx ? fds[0] : -1, 0));
+					if (fds[idx] < 0)
+						return; // e.g. restricted by perf_event_paranoid, or not supported in a VM
+				}
+				opened = true;
+#if ECS_STAT_PERF_RDPMC
+				page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+				for (int idx = 0; idx < ECounter::_Count; idx++)
+				{
+					void* page = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fds[idx], 0);
+					pages[idx] = (MAP_FAILED == page) ? nullptr : static_cast<perf_event_mmap_page*>(page);
+				}
+#endif
+			}
+
+			~ThreadGroup()
+			{
+#if ECS_STAT_PERF_RDPMC
+				for (perf_event_mmap_page* page : pages)
+				{
+					if (page)
+						munmap(page, page_size);
+				}
+#endif
+				for (int fd : fds)
+				{
+					if (fd >= 0)
+						close(fd);
+				}
+			}
+
+#if ECS_STAT_PERF_RDPMC
+			// The self-monitoring protocol of perf_event_mmap_page. False, when the counter is not on the PMU now.
+			static bool ReadMapped(const perf_event_mmap_page* page, int64_t& out)
+			{
+				const volatile perf_event_mmap_page& mapped = *page;
+				uint32_t seq = 0;
+				do
+				{
+					seq = mapped.lock;
+					std::atomic_signal_fence(std::memory_order_seq_cst);
+					const uint32_t index = mapped.index;
+					if (!mapped.cap_user_rdpmc || !index)
+						return false;
+					const uint32_t shift = 64 - mapped.pmc_width;
+					out = mapped.offset + (static_cast<int64_t>(__rdpmc(static_cast<int>(index - 1)) << shift) >> shift);
+					std::atomic_signal_fence(std::memory_order_seq_cst);
+				} while (mapped.lock != seq);
+				return true;
+			}
+
+			bool ReadMapped(Values& result) const
+			{
+				for (int idx = 0; idx < ECounter::_Count; idx++)
+				{
+					if (!pages[idx] || !ReadMapped(pages[idx], result[idx]))
+						return false;
+				}
+				return true;
+			}
+#endif
+
+			// One read of the group leader returns all counters.
+			bool ReadGroup(Values& result) const
+			{
+				uint64_t buffer[1 + ECounter::_Count] = {};
+				if ((read(fds[0], buffer, sizeof(buffer)) != sizeof(buffer)) || (ECounter::_Count != buffer[0]))
+					return false;
+				for (int idx = 0; idx < ECounter::_Count; idx++)
+				{
+					result[idx] = static_cast<int64_t>(buffer[1 + idx]);
+				}
+				return true;
+			}
+		};
+#endif // __linux__
+
+	public:
+		// Zeros, when the counters couldn't be opened, or the platform has no backend.
+		static Values Read()
+		{
+			Values result = {};
+#ifdef __linux__
+			thread_local ThreadGroup group;
+			if (!group.opened)
+				return result;
+#if ECS_STAT_PERF_RDPMC
+			if (group.ReadMapped(result))
+				return result;
+#endif
+			if (!group.ReadGroup(result))
+			{
+				result = {};
+			}
+#endif
+			return result;
+		}
+	};
+#endif // ECS_STAT_PERF_COUNTERS
+
+	// Every thread slot (see CurrentThreadSlot) updates its own cache line padded records without read-modify-write atomics.
+	// Threads without a slot share the last records, updated atomically. Slots are summed up by LogAll.
 	struct Stat
 	{
+		constexpr static const uint32_t kSharedSlot = kMaxThreadSlots;
+		constexpr static const uint32_t kSlotNum = kMaxThreadSlots + 1;
+
 		struct Record
 		{
-			std::atomic_int64_t sum = 0;
+			std::atomic_int64_t sum = 0; // ticks
 			std::atomic_int64_t max = 0;
 			std::atomic_int64_t calls = 0;
+			std::atomic_int64_t window_sum = 0; // since the last EndFrame
 
 			Record() = default;
 			Record(const Record& other)
 				: sum(other.sum.load())
 				, max(other.max.load())
 				, calls(other.calls.load())
+				, window_sum(other.window_sum.load())
 			{}
 
 			Record& operator=(const Record& other)
@@ -58,16 +267,162 @@ namespace ECS
 				sum = other.sum.load();
 				max = other.max.load();
 				calls = other.calls.load();
+				window_sum = other.window_sum.load();
 				return *this;
 			}
 		};
 
+		// Log bucketed (like HDR histograms): values below kSubBuckets are exact, above every power of 2 is split
+		// into kSubBuckets linear buckets, so the relative error is below 1 / kSubBuckets.
+		struct alignas(kCacheLineSize) Histogram
+		{
+			constexpr static const uint32_t kSubBucketBits = 3;
+			constexpr static const uint32_t kSubBuckets = 1 << kSubBucketBits;
+			constexpr static const uint32_t kBucketNum = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+			std::atomic_uint32_t counts[kBucketNum] = {};
+
+			static uint32_t BucketIndex(uint64_t value)
+			{
+				if (value < kSubBuckets)
+					return static_cast<uint32_t>(value);
+				const uint32_t shift = (63 - std::countl_zero(value)) - kSubBucketBits;
+				return (shift + 1) * kSubBuckets + static_cast<uint32_t>((value >> shift) & (kSubBuckets - 1));
+			}
+
+			// The middle of the bucket.
+			static uint64_t BucketValue(uint32_t idx)
+			{
+				if (idx < kSubBuckets)
+					return idx;
+				const uint32_t shift = idx / kSubBuckets - 1;
+				return ((uint64_t(kSubBuckets + idx % kSubBuckets)) << shift) + ((uint64_t(1) << shift) >> 1);
+			}
+
+			// Atomic read-modify-write only, when the histogram is shared by threads.
+			void Add(int64_t value, bool shared)
+			{
+				std::atomic_uint32_t& count = counts[BucketIndex(static_cast<uint64_t>(std::max<int64_t>(value, 0)))];
+				if (shared)
+				{
+					count.fetch_add(1, std::memory_order_relaxed);
+				}
+				else
+				{
+					count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				}
+			}
+
+			void Reset()
+			{
+				for (auto& count : counts)
+				{
+					count.store(0, std::memory_order_relaxed);
+				}
+			}
+
+			// Sums counts of histogram_num histograms (every stride one) and returns the values for the fractions (sorted ascending).
+			template<std::size_t N>
+			static std::array<uint64_t, N> Percentiles(const Histogram* histograms, uint32_t histogram_num, uint32_t stride
+				, const std::array<double, N>& fractions)
+			{
+				std::array<uint64_t, N> result = {};
+				uint64_t total = 0;
+				for (uint32_t h = 0; h < histogram_num; h++)
+				{
+					for (const auto& count : histograms[h * stride].counts)
+					{
+						total += count.load(std::memory_order_relaxed);
+					}
+				}
+				if (!total)
+					return result;
+				uint64_t cumulative = 0;
+				std::size_t fraction_idx = 0;
+				for (uint32_t idx = 0; (idx < kBucketNum) && (fraction_idx < N); idx++)
+				{
+					for (uint32_t h = 0; h < histogram_num; h++)
+					{
+						cumulative += histograms[h * stride].counts[idx].load(std::memory_order_relaxed);
+					}
+					while ((fraction_idx < N) && (cumulative >= fractions[fraction_idx] * total))
+					{
+						result[fraction_idx++] = BucketValue(idx);
+					}
+				}
+				return result;
+			}
+		};
+
+		struct alignas(kCacheLineSize) RecordLine
+		{
+			constexpr static const uint32_t kRecordsNum = kCacheLineSize / sizeof(Record);
+			static_assert(kRecordsNum > 0, "");
+			Record records[kRecordsNum];
+		};
+
+#if ECS_STAT_PERF_COUNTERS
+		struct alignas(kCacheLineSize) CounterRecord
+		{
+			std::atomic_int64_t values[PerfCounters::_Count] = {};
+
+			void Add(const PerfCounters::Values& delta, bool shared)
+			{
+				for (int idx = 0; idx < PerfCounters::_Count; idx++)
+				{
+					if (shared)
+					{
+						values[idx].fetch_add(delta[idx], std::memory_order_relaxed);
+					}
+					else
+					{
+						values[idx].store(values[idx].load(std::memory_order_relaxed) + delta[idx], std::memory_order_relaxed);
+					}
+				}
+			}
+		};
+#endif
+
 		using FStatToStr = std::add_pointer<const char*(uint32_t)>::type;
 
 		struct RecordGroup
 		{
-			std::vector<Record> records;
+			std::vector<RecordLine> lines; // lines_per_slot lines for every slot
+			std::vector<Histogram> call_histograms; // [slot * record_num + record_index]
+			std::vector<Histogram> frame_histograms; // [record_index], of window sums, added by EndFrame
+#if ECS_STAT_PERF_COUNTERS
+			std::vector<CounterRecord> counters; // [slot * record_num + record_index]
+#endif
+			uint32_t lines_per_slot = 0;
+			uint32_t record_num = 0;
 			FStatToStr stat_to_str = nullptr;
+
+			Histogram& GetCallHistogram(uint32_t slot, uint32_t record_index)
+			{
+				assert(slot < kSlotNum);
+				assert(record_index < record_num);
+				return call_histograms[slot * record_num + record_index];
+			}
+
+			Record& Get(uint32_t slot, uint32_t record_index)
+			{
+				assert(slot < kSlotNum);
+				assert(record_index < record_num);
+				return lines[slot * lines_per_slot + record_index / RecordLine::kRecordsNum].records[record_index % RecordLine::kRecordsNum];
+			}
+
+			Record Sum(uint32_t record_index)
+			{
+				Record result;
+				for (uint32_t slot = 0; slot < kSlotNum; slot++)
+				{
+					const Record& record = Get(slot, record_index);
+					result.sum += record.sum.load(std::memory_order_relaxed);
+					result.calls += record.calls.load(std::memory_order_relaxed);
+					result.max = std::max(result.max.load(), record.max.load(std::memory_order_relaxed));
+				}
+				return result;
+			}
 		};
 
 		struct StaticData
@@ -77,6 +432,7 @@ namespace ECS
 		private:
 			StaticData() : groups(4)
 			{
+				StatTimer::TicksPerMs(); // starts the calibration
 				AddGroup(Details::EStatId::_Count, EPredefinedStatGroups::InnerLibrary, [](uint32_t idx) -> const char*
 				{
 					const Details::EStatId id = static_cast<Details::EStatId>(idx);
@@ -105,48 +461,121 @@ namespace ECS
 					groups.resize(group_idx+1);
 				}
 				RecordGroup& group = groups[group_idx];
-				assert(group.records.empty());
+				assert(group.lines.empty());
 				const uint32_t record_num = static_cast<uint32_t>(in_record_num);
 				assert(record_num > 0);
-				group.records = std::vector<Record>(record_num);
+				group.record_num = record_num;
+				group.lines_per_slot = (record_num + RecordLine::kRecordsNum - 1) / RecordLine::kRecordsNum;
+				group.lines = std::vector<RecordLine>(group.lines_per_slot * kSlotNum);
+				group.call_histograms = std::vector<Histogram>(record_num * kSlotNum);
+				group.frame_histograms = std::vector<Histogram>(record_num);
+#if ECS_STAT_PERF_COUNTERS
+				group.counters = std::vector<CounterRecord>(record_num * kSlotNum);
+#endif
 				assert(!group.stat_to_str);
 				group.stat_to_str = stat_to_str;
 				assert(group.stat_to_str);
 			}
 		};
 
-		static void Add(const uint32_t record_index, const uint32_t group_idx, std::chrono::microseconds duration_time)
+		static void Add(const uint32_t record_index, const uint32_t group_idx, const StatTimer::Ticks duration)
 		{
-			const auto microseconds = duration_time.count();
-			Record& record = StaticData::Get().groups[group_idx].records[record_index];
-			record.calls++;
-			record.sum += microseconds;
-			if (microseconds > record.max)
-				record.max = microseconds;
+			const uint32_t thread_slot = CurrentThreadSlot();
+			if (kNoThreadSlot == thread_slot)
+			{
+				RecordGroup& group = StaticData::Get().groups[group_idx];
+				Record& record = group.Get(kSharedSlot, record_index);
+				record.calls++;
+				record.sum += duration;
+				record.window_sum += duration;
+				int64_t max = record.max.load(std::memory_order_relaxed);
+				while ((duration > max) && !record.max.compare_exchange_weak(max, duration, std::memory_order_relaxed)) {}
+				group.GetCallHistogram(kSharedSlot, record_index).Add(duration, true);
+				return;
+			}
+			RecordGroup& group = StaticData::Get().groups[group_idx];
+			Record& record = group.Get(thread_slot, record_index);
+			record.calls.store(record.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			record.sum.store(record.sum.load(std::memory_order_relaxed) + duration, std::memory_order_relaxed);
+			record.window_sum.store(record.window_sum.load(std::memory_order_relaxed) + duration, std::memory_order_relaxed);
+			if (duration > record.max.load(std::memory_order_relaxed))
+				record.max.store(duration, std::memory_order_relaxed);
+			group.GetCallHistogram(thread_slot, record_index).Add(duration, false);
+		}
+
+#if ECS_STAT_PERF_COUNTERS
+		static void AddCounters(const uint32_t record_index, const uint32_t group_idx, const PerfCounters::Values& delta)
+		{
+			const uint32_t thread_slot = CurrentThreadSlot();
+			const bool shared = (kNoThreadSlot == thread_slot);
+			RecordGroup& group = StaticData::Get().groups[group_idx];
+			group.counters[(shared ? kSharedSlot : thread_slot) * group.record_num + record_index].Add(delta, shared);
+		}
+#endif
+
+		// Closes the per frame window: the time of every record in the frame is added to its frame histogram.
+		// Records not used in the frame are skipped. Call it from the main thread once per frame.
+		static void EndFrame()
+		{
+			for (auto& group : StaticData::Get().groups)
+			{
+				for (uint32_t i = 0; i < group.record_num; i++)
+				{
+					int64_t frame_sum = 0;
+					for (uint32_t slot = 0; slot < kSlotNum; slot++)
+					{
+						frame_sum += group.Get(slot, i).window_sum.exchange(0, std::memory_order_relaxed);
+					}
+					if (frame_sum > 0)
+					{
+						group.frame_histograms[i].Add(frame_sum, false);
+					}
+				}
+			}
 		}
 
 		static void Reset()
 		{
 			for (auto& group : StaticData::Get().groups)
 			{
-				for (Record& r : group.records)
+				for (RecordLine& line : group.lines)
+				{
+					for (Record& r : line.records)
+					{
+						r = Record{};
+					}
+				}
+				for (Histogram& histogram : group.call_histograms)
+				{
+					histogram.Reset();
+				}
+				for (Histogram& histogram : group.frame_histograms)
 				{
-					r = Record{};
+					histogram.Reset();
 				}
+#if ECS_STAT_PERF_COUNTERS
+				for (CounterRecord& counter : group.counters)
+				{
+					for (auto& value : counter.values)
+					{
+						value.store(0, std::memory_order_relaxed);
+					}
+				}
+#endif
 			}
 		}
 
 		static void LogAll(int64_t frames)
 		{
 			printf_s("Frame: %lli\n", frames);
-			for (const auto& group : StaticData::Get().groups)
+			const double to_ms = 1.0 / StatTimer::TicksPerMs();
+			for (auto& group : StaticData::Get().groups)
 			{
-				for (int i = 0; i < group.records.size(); i++)
+				for (uint32_t i = 0; i < group.record_num; i++)
 				{
-					const Record& record = group.records[i];
+					const Record record = group.Sum(i);
 					if (record.calls > 0)
 					{
-						constexpr double to_ms = 1.0 / 1000.0;
 						const char* name = group.stat_to_str ? group.stat_to_str(i) : nullptr;
 						printf_s("Stat %-28s avg per call: %7.3f avg per frame: %7.3f max: %7.3f calls per frame: %7.3f\n"
 							, (name ? name : "unknown")
@@ -154,6 +583,34 @@ namespace ECS
 							, record.sum * to_ms / frames
 							, record.max * to_ms
 							, double(record.calls) / frames);
+						constexpr std::array<double, 4> kFractions = { 0.5, 0.9, 0.99, 0.999 };
+						const auto per_call = Histogram::Percentiles(&group.call_histograms[i], kSlotNum, group.record_num, kFractions);
+						const auto per_frame = Histogram::Percentiles(&group.frame_histograms[i], 1, 1, kFractions);
+						const double to_us = to_ms * 1000.0;
+						printf_s("     %-28s per call [us]  p50: %9.3f p90: %9.3f p99: %9.3f p99.9: %9.3f\n"
+							, "", per_call[0] * to_us, per_call[1] * to_us, per_call[2] * to_us, per_call[3] * to_us);
+						printf_s("     %-28s per frame [us] p50: %9.3f p90: %9.3f p99: %9.3f p99.9: %9.3f\n"
+							, "", per_frame[0] * to_us, per_frame[1] * to_us, per_frame[2] * to_us, per_frame[3] * to_us);
+#if ECS_STAT_PERF_COUNTERS
+						double counters[PerfCounters::_Count] = {};
+						for (uint32_t slot = 0; slot < kSlotNum; slot++)
+						{
+							for (int c = 0; c < PerfCounters::_Count; c++)
+							{
+								counters[c] += group.counters[slot * group.record_num + i].values[c].load(std::memory_order_relaxed);
+							}
+						}
+						if (counters[PerfCounters::Cycles] > 0)
+						{
+							// low IPC with many LLC misses per kilo instruction: memory bound
+							const double instructions = std::max(counters[PerfCounters::Instructions], 1.0);
+							printf_s("     %-28s per call cycles: %11.0f instructions: %11.0f IPC: %5.2f LLC MPKI: %7.3f branch MPKI: %7.3f\n"
+								, "", counters[PerfCounters::Cycles] / record.calls, counters[PerfCounters::Instructions] / record.calls
+								, counters[PerfCounters::Instructions] / counters[PerfCounters::Cycles]
+								, 1000.0 * counters[PerfCounters::LLCMisses] / instructions
+								, 1000.0 * counters[PerfCounters::BranchMisses] / instructions);
+						}
+#endif
 					}
 				}
 			}
@@ -176,27 +633,260 @@ namespace ECS
 		return group.stat_to_str ? group.stat_to_str(id.GetIndex()) : "unknown";
 	}
 
+	// Timeline of the measured scopes in a requested range of frames, written as Chrome trace json (chrome://tracing, ui.perfetto.dev).
+	// Every thread slot writes into its own ring buffer, threads without a slot share the last one. The oldest events are overwritten.
+	struct Trace
+	{
+		constexpr static const uint32_t kSharedSlot = Stat::kSharedSlot;
+		constexpr static const uint32_t kSlotNum = Stat::kSlotNum;
+		constexpr static const uint64_t kRingSize = 1 << 16;
+
+		struct Event
+		{
+			StatTimer::Ticks begin = 0;
+			StatTimer::Ticks end = 0;
+			const char* name = nullptr; // when not a stat record
+			uint32_t group_idx = 0;
+			uint32_t record_index = 0;
+			int64_t frame = 0;
+		};
+
+		struct alignas(kCacheLineSize) Ring
+		{
+			std::vector<Event> events; // allocated by the first request
+			std::atomic_uint64_t written = 0;
+			std::atomic_uint32_t state = 0; // kCapturingBit and the number of writers, one word so the writer needs no seq_cst
+		};
+
+		constexpr static const uint32_t kCapturingBit = 1u << 31;
+
+	private:
+		Ring rings[kSlotNum];
+		std::atomic_bool capturing = false;
+		std::atomic_int64_t frame = 0;
+
+		// main thread only
+		int64_t first_frame = -1;
+		int64_t end_frame = -1;
+		StatTimer::Ticks capture_start = 0;
+		std::string path;
+
+		static Trace& Get()
+		{
+			static Trace trace;
+			return trace;
+		}
+
+		void Start()
+		{
+			for (Ring& ring : rings)
+			{
+				if (ring.events.empty())
+				{
+					ring.events.resize(kRingSize);
+				}
+				ring.written.store(0, std::memory_order_relaxed);
+				ring.state.fetch_or(kCapturingBit, std::memory_order_release);
+			}
+			capture_start = StatTimer::Now();
+			capturing.store(true, std::memory_order_relaxed);
+		}
+
+		void Stop()
+		{
+			capturing.store(false, std::memory_order_relaxed);
+			for (Ring& ring : rings)
+			{
+				// Writers, that incremented the state before the bit was cleared, write their event.
+				ring.state.fetch_and(~kCapturingBit, std::memory_order_relaxed);
+				while (ring.state.load(std::memory_order_acquire) & ~kCapturingBit)
+				{
+					std::this_thread::yield();
+				}
+			}
+			WriteChromeJson();
+			first_frame = end_frame = -1;
+		}
+
+		static const char* SlotName(uint32_t slot, char (&buffer)[32])
+		{
+			if (0 == slot)
+				return "Main";
+			if (kSharedSlot == slot)
+				return "Other threads";
+			snprintf(buffer, sizeof(buffer), "Worker %u", slot - 1);
+			return buffer;
+		}
+
+		void WriteChromeJson() const
+		{
+			FILE* file = nullptr;
+			if (fopen_s(&file, path.c_str(), "w") || !file)
+				return;
+			const double to_us = 1000.0 / StatTimer::TicksPerMs();
+			fprintf_s(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+			bool first = true;
+			for (uint32_t slot = 0; slot < kSlotNum; slot++)
+			{
+				const Ring& ring = rings[slot];
+				const uint64_t written = ring.written.load(std::memory_order_acquire);
+				if (!written)
+					continue;
+				char buffer[32];
+				fprintf_s(file, "%s{\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}\n"
+					, (first ? "" : ","), slot, SlotName(slot, buffer));
+				first = false;
+				for (uint64_t idx = (written > kRingSize) ? (written - kRingSize) : 0; idx < written; idx++)
+				{
+					const Event& e = ring.events[idx % kRingSize];
+					const auto& group = Stat::StaticData::Get().groups[e.group_idx];
+					const char* name = e.name ? e.name : (group.stat_to_str ? group.stat_to_str(e.record_index) : nullptr);
+					const StatTimer::Ticks begin = std::max(e.begin, capture_start); // scopes entered before the capture are cut
+					fprintf_s(file, ",{\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"name\":\"%s\",\"cat\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lli}}\n"
+						, slot, (name ? name : "unknown"), (e.name ? "Trace" : GroupName(e.group_idx))
+						, (begin - capture_start) * to_us, (e.end - begin) * to_us, static_cast<long long>(e.frame));
+				}
+			}
+			fprintf_s(file, "]}\n");
+			fclose(file);
+		}
+
+		static const char* GroupName(uint32_t group_idx)
+		{
+			switch (group_idx)
+			{
+				case EPredefinedStatGroups::InnerLibrary: return "InnerLibrary";
+				case EPredefinedStatGroups::Framework: return "Framework";
+				case EPredefinedStatGroups::ExecutionNode: return "ExecutionNode";
+			}
+			return "Custom";
+		}
+
+		void Add(const Event& e)
+		{
+			const uint32_t thread_slot = CurrentThreadSlot();
+			const bool shared = (kNoThreadSlot == thread_slot);
+			Ring& ring = rings[shared ? kSharedSlot : thread_slot];
+			// The ring of a slot has a single writer, so the RMWs are not contended.
+			if (ring.state.fetch_add(1, std::memory_order_acquire) & kCapturingBit)
+			{
+				const uint64_t idx = shared
+					? ring.written.fetch_add(1, std::memory_order_relaxed)
+					: ring.written.load(std::memory_order_relaxed);
+				Event& ring_event = ring.events[idx % kRingSize];
+				ring_event = e;
+				ring_event.frame = frame.load(std::memory_order_relaxed);
+				if (!shared)
+				{
+					ring.written.store(idx + 1, std::memory_order_release);
+				}
+			}
+			ring.state.fetch_sub(1, std::memory_order_release);
+		}
+
+	public:
+		static bool IsCapturing()
+		{
+			return Get().capturing.load(std::memory_order_relaxed);
+		}
+
+		static void Add(StatTimer::Ticks begin, StatTimer::Ticks end, uint32_t group_idx, uint32_t record_index)
+		{
+			Get().Add(Event{ begin, end, nullptr, group_idx, record_index });
+		}
+
+		// The name must outlive the capture (a literal).
+		static void Add(StatTimer::Ticks begin, StatTimer::Ticks end, const char* name)
+		{
+			Get().Add(Event{ begin, end, name });
+		}
+
+		// Captures frames [in_first_frame, in_first_frame + frame_num) into the file. Ignored while a capture is pending.
+		static bool Request(int64_t in_first_frame, int64_t frame_num, const char* in_path)
+		{
+			Trace& trace = Get();
+			if ((trace.first_frame >= 0) || (frame_num <= 0))
+				return false;
+			trace.first_frame = in_first_frame;
+			trace.end_frame = in_first_frame + frame_num;
+			trace.path = in_path;
+			return true;
+		}
+
+		// Call it from the main thread at the start of every frame.
+		static void OnFrame(int64_t in_frame)
+		{
+			Trace& trace = Get();
+			trace.frame.store(in_frame, std::memory_order_relaxed);
+			if (trace.first_frame < 0)
+				return;
+			const bool capture = trace.capturing.load(std::memory_order_relaxed);
+			if (!capture && (in_frame >= trace.first_frame))
+			{
+				trace.Start();
+			}
+			else if (capture && (in_frame >= trace.end_frame))
+			{
+				trace.Stop();
+			}
+		}
+	};
+
+	// Traced, but not a stat record.
+	struct TraceScope
+	{
+	private:
+		const StatTimer::Ticks start;
+		const char* const name;
+	public:
+		TraceScope(const char* in_name)
+			: start(Trace::IsCapturing() ? StatTimer::Now() : 0), name(in_name) {}
+
+		~TraceScope()
+		{
+			if (start && Trace::IsCapturing())
+			{
+				Trace::Add(start, StatTimer::Now(), name);
+			}
+		}
+	};
+
 	struct ScopeDurationLog
 	{
 	private:
-		const std::chrono::time_point<std::chrono::high_resolution_clock> start;
+#if ECS_STAT_PERF_COUNTERS
+		const PerfCounters::Values counters_start = PerfCounters::Read(); // before the start (and read after the end), so the measured duration excludes the reads
+#endif
+		const StatTimer::Ticks start;
 		const uint32_t group_idx;
 		const uint32_t record_index;
 	public:
 		ScopeDurationLog(ExecutionNodeId in_id)
-			: start(std::chrono::high_resolution_clock::now())
+			: start(StatTimer::Now())
 			, group_idx(static_cast<int>(EPredefinedStatGroups::ExecutionNode)), record_index(in_id.GetIndex()) {}
 
 		template<typename RecordIdx, typename GroupIdx>
 		ScopeDurationLog(RecordIdx in_record_num, GroupIdx in_group_idx)
-			: start(std::chrono::high_resolution_clock::now())
+			: start(StatTimer::Now())
 			, group_idx(static_cast<int>(in_group_idx))
 			, record_index(static_cast<int>(in_record_num)) {}
 
 		~ScopeDurationLog()
 		{
-			const auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start);
-			Stat::Add(record_index, group_idx, duration_us);
+			const StatTimer::Ticks end = StatTimer::Now();
+#if ECS_STAT_PERF_COUNTERS
+			PerfCounters::Values delta = PerfCounters::Read();
+			for (int idx = 0; idx < PerfCounters::_Count; idx++)
+			{
+				delta[idx] -= counters_start[idx];
+			}
+			Stat::AddCounters(record_index, group_idx, delta);
+#endif
+			Stat::Add(record_index, group_idx, end - start);
+			if (Trace::IsCapturing())
+			{
+				Trace::Add(start, end, group_idx, record_index);
+			}
 		}
 	};
 
@@ -224,6 +914,11 @@ namespace ECS
 		template<typename T> ScopeDurationLog(T) {}
 		template<typename T1, typename T2> ScopeDurationLog(T1, T2) {}
 	};
+
+	struct TraceScope
+	{
+		TraceScope(const char*) {}
+	};
 #endif // ECS_STAT_ENABLED
 }
 #undef LOG
@@ -12,3 +12,4 @@ IMPLEMENT_COMPONENT(Sprite2D);
 IMPLEMENT_COMPONENT(Animation);
 IMPLEMENT_COMPONENT(Damage);
 IMPLEMENT_COMPONENT(LifeTime);
+IMPLEMENT_COMPONENT(PreviousPosition);
\ No newline at end of file
@@ -59,4 +59,11 @@ struct Damage : public ECS::Component<__COUNTER__, ECS::SortedComponentContainer
 struct LifeTime : public ECS::Component<__COUNTER__, ECS::SortedComponentContainer<LifeTime, false /* no binary search */>>
 {
 	float time = 0.0f;
+};
+
+//SIMULATION
+// Position before the last simulation tick, the rendered one is interpolated.
+struct PreviousPosition : public ECS::Component<__COUNTER__, ECS::DenseComponentContainer<PreviousPosition>>
+{
+	sf::Vector2f pos;
 };
\ No newline at end of file
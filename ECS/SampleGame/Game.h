@@ -8,13 +8,33 @@ struct EExecutionNode
 {
 	constexpr static const ExecutionNodeId Graphic_Update{ 0 };
 	constexpr static const ExecutionNodeId Movement_Update{ 1 };
-	constexpr static const ExecutionNodeId TestOverlap{ 2 };
+	constexpr static const ExecutionNodeId TestOverlap_Phase0{ 2 };
+	constexpr static const ExecutionNodeId QuadTreeRebuild_Count{ 3 };
+	constexpr static const ExecutionNodeId QuadTreeRebuild_Prefix{ 4 };
+	constexpr static const ExecutionNodeId QuadTreeRebuild_Scatter{ 5 };
+	constexpr static const ExecutionNodeId Broadphase{ 6 };
+	constexpr static const ExecutionNodeId TestOverlap_Phase1{ 7 };
+	constexpr static const ExecutionNodeId TestOverlap_Phase2{ 8 };
+	constexpr static const ExecutionNodeId TestOverlap_Phase3{ 9 };
+	constexpr static const ExecutionNodeId Graphic_PublishSnapshot{ 10 };
+	constexpr static const ExecutionNodeId TestOverlap_Serial{ 11 };
+	constexpr static const ExecutionNodeId Graphic_UpdateRadius{ 12 };
 };
 
 struct GameInstance : public BaseGameInstance
 {
 	void InitializeGame() override
 	{
+		rebuild_quad_tree = false; // the quad tree is maintained by the Position observers
+		pipelined_render = true;
+		fixed_timestep = true;
+		out_of_board_events.SetDeterministic(true); // entity removal order decides the reused ids
+		event_manager.RegisterChannel(out_of_board_events);
+		if (!rebuild_quad_tree)
+		{
+			ecs.RegisterObserver<ECS::OnAdd<Position>>(&QuadTree_OnAddPosition);
+			ecs.RegisterObserver<ECS::OnRemove<Position>>(&QuadTree_OnRemovePosition);
+		}
 		const float pi = acosf(-1);
 		for (int j = 0; j < 20; j++)
 		{
@@ -22,26 +42,67 @@ struct GameInstance : public BaseGameInstance
 			{
 				const auto e = ecs.AddEntity();
 				ecs.AddComponent<Position>(e).pos = sf::Vector2f(i * 800 / 20.0f, j * 600 / 20.0f);
+				ecs.AddComponent<PreviousPosition>(e).pos = ecs.GetComponent<Position>(e).pos;
 				ecs.AddComponent<CircleSize>(e).radius = 10;
 				ecs.AddComponent<Sprite2D>(e).shape.setFillColor(sf::Color::Green);
 				const float angle = pi * 2.0f * (i + 1) / 22.0f;
 				ecs.AddComponent<Velocity>(e).velocity = sf::Vector2f(sinf(angle), cosf(angle));
 				ecs.AddComponent<Animation>(e);
-
-				quad_tree.Add(e, ToRegion(ecs.GetComponent<Position>(e), ecs.GetComponent<CircleSize>(e)));
 			}
 		}
 	}
 
+	void DispatchGraphicTasks() override
+	{
+		ecs.CallAsync<Filter<Changed<CircleSize>>>(&GraphicSystem_UpdateRadius, ECS::Tag{}, EExecutionNode::Graphic_UpdateRadius);
+		if (pipelined_render)
+		{
+			render_snapshot.ToWrite(static_cast<int64_t>(frames)).clear();
+			ecs.CallAsync(&GraphicSystem_Update, ECS::Tag{}, EExecutionNode::Graphic_Update, EExecutionNode::Graphic_UpdateRadius);
+			ecs.CallAsyncJob(&GraphicSystem_PublishSnapshot, EExecutionNode::Graphic_PublishSnapshot, 1, EExecutionNode::Graphic_Update, &wait_for_graphic_update);
+		}
+		else
+		{
+			ecs.CallAsync(&GraphicSystem_Update, ECS::Tag{}, EExecutionNode::Graphic_Update, EExecutionNode::Graphic_UpdateRadius, &wait_for_graphic_update);
+		}
+	}
+
 	void DispatchTasks() override
 	{
-		ecs.CallAsync(&GraphicSystem_Update, ECS::Tag{}, EExecutionNode::Graphic_Update, ExecutionNodeIdSet{}, &wait_for_graphic_update);
-		ecs.CallAsyncOverlap(&TestOverlap_FirstPass, &TestOverlap_SecondPass, ECS::Tag{}, ECS::Tag{}, EExecutionNode::TestOverlap);
-		ecs.CallAsync(&GameMovement_Update, ECS::Tag{}, EExecutionNode::Movement_Update, EExecutionNode::TestOverlap);
+		ecs.CallAsyncJob<const CircleSize>(&Broadphase_GeneratePairs, EExecutionNode::Broadphase, kBroadphaseParts);
+		ecs.CallAsyncJob<const Position, const CircleSize, Velocity>(&TestOverlap_Narrowphase<0>, EExecutionNode::TestOverlap_Phase0, kBroadphaseParts, EExecutionNode::Broadphase);
+		ecs.CallAsyncJob<const Position, const CircleSize, Velocity>(&TestOverlap_Narrowphase<1>, EExecutionNode::TestOverlap_Phase1, kBroadphaseParts, EExecutionNode::TestOverlap_Phase0);
+		ecs.CallAsyncJob<const Position, const CircleSize, Velocity>(&TestOverlap_Narrowphase<2>, EExecutionNode::TestOverlap_Phase2, kBroadphaseParts, EExecutionNode::TestOverlap_Phase1);
+		ecs.CallAsyncJob<const Position, const CircleSize, Velocity>(&TestOverlap_Narrowphase<3>, EExecutionNode::TestOverlap_Phase3, kBroadphaseParts, EExecutionNode::TestOverlap_Phase2);
+		ecs.CallAsyncJob<const Position, const CircleSize, Velocity>(&TestOverlap_Serial, EExecutionNode::TestOverlap_Serial, 1, EExecutionNode::TestOverlap_Phase3);
+
+		ExecutionNodeIdSet movement_requirements{ EExecutionNode::TestOverlap_Serial };
+		if (rebuild_quad_tree)
+		{
+			constexpr uint16_t kChunks = ECS::kMaxConcurrentWorkerThreads + 1;
+			ecs.CallAsyncParallel(&QuadTreeRebuild_Count, ECS::Tag{}, EExecutionNode::QuadTreeRebuild_Count, kChunks);
+			ecs.CallAsyncJob(&QuadTreeRebuild_Prefix, EExecutionNode::QuadTreeRebuild_Prefix, kChunks, EExecutionNode::QuadTreeRebuild_Count);
+			ecs.CallAsyncParallel(&QuadTreeRebuild_Scatter, ECS::Tag{}, EExecutionNode::QuadTreeRebuild_Scatter, kChunks, EExecutionNode::QuadTreeRebuild_Prefix);
+			movement_requirements.Add(EExecutionNode::QuadTreeRebuild_Scatter); // Scatter must see the positions Count saw
+		}
+		ecs.CallAsync(&GameMovement_Update, ECS::Tag{}, EExecutionNode::Movement_Update, movement_requirements);
+		event_manager.DispatchChannels(ecs, EExecutionNode::Movement_Update); // events are pushed by the movement
 	}
 
 	void Render() override 
 	{
+		if (pipelined_render)
+		{
+			sf::CircleShape shape;
+			for (const RenderItem& item : render_snapshot.ToRender(snapshot_to_render))
+			{
+				shape.setPosition(item.position);
+				shape.setRadius(item.radius);
+				shape.setFillColor(item.color);
+				window.draw(shape);
+			}
+			return;
+		}
 		ecs.CallBlocking(&GraphicSystem_RenderSync, ECS::Tag::Any());
 	}
 };
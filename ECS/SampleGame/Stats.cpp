@@ -6,11 +6,21 @@
 namespace
 {
 	using namespace ECS;
-	static Stat::Register static_stat_register(3, EPredefinedStatGroups::ExecutionNode, [](uint32_t eid)
+	static Stat::Register static_stat_register(13, EPredefinedStatGroups::ExecutionNode, [](uint32_t eid)
 	{
 		if (eid == EExecutionNode::Graphic_Update.GetIndex()) return "Graphic_Update";
 		if (eid == EExecutionNode::Movement_Update.GetIndex()) return "Movement_Update";
-		if (eid == EExecutionNode::TestOverlap.GetIndex()) return "TestOverlap";
+		if (eid == EExecutionNode::TestOverlap_Phase0.GetIndex()) return "TestOverlap_Phase0";
+		if (eid == EExecutionNode::QuadTreeRebuild_Count.GetIndex()) return "QuadTreeRebuild_Count";
+		if (eid == EExecutionNode::QuadTreeRebuild_Prefix.GetIndex()) return "QuadTreeRebuild_Prefix";
+		if (eid == EExecutionNode::QuadTreeRebuild_Scatter.GetIndex()) return "QuadTreeRebuild_Scatter";
+		if (eid == EExecutionNode::Broadphase.GetIndex()) return "Broadphase";
+		if (eid == EExecutionNode::TestOverlap_Phase1.GetIndex()) return "TestOverlap_Phase1";
+		if (eid == EExecutionNode::TestOverlap_Phase2.GetIndex()) return "TestOverlap_Phase2";
+		if (eid == EExecutionNode::TestOverlap_Phase3.GetIndex()) return "TestOverlap_Phase3";
+		if (eid == EExecutionNode::Graphic_PublishSnapshot.GetIndex()) return "Graphic_PublishSnapshot";
+		if (eid == EExecutionNode::TestOverlap_Serial.GetIndex()) return "TestOverlap_Serial";
+		if (eid == EExecutionNode::Graphic_UpdateRadius.GetIndex()) return "Graphic_UpdateRadius";
 		return "unknown";
 	});
 }
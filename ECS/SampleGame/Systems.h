@@ -3,53 +3,161 @@
 #include "Components.h"
 #include "BaseGame/GameBase.h"
 
+// Broadphase pairs of circles, that fit in kPairPhaseBlock leaves, are processed in phases, see QuadTree::GeneratePhasedPairs.
+const uint32_t kPairPhaseBlock = 1;
+
+const uint32_t kQuadPixelSize = 32;
+const float kQuadPositionOffset = 64;
+
+// The region of a smaller circle spans at most kPairPhaseBlock + 1 leaves, wherever it is.
+// Checked with the current radius, so the radius must not grow between the quad tree update and the broadphase.
+static bool ExceedsPairPhaseBlock(const CircleSize& size)
+{
+	return (2.0f * size.radius) >= static_cast<float>(kPairPhaseBlock * kQuadPixelSize);
+}
+
 static QuadTree<ECS::EntityId>::Region ToRegion(const Position& pos, const CircleSize& size)
 {
-	const uint32_t kQuadPixelSize = 32;
-	const float position_offset = 64;
-	return QuadTree<ECS::EntityId>::Region{
-		static_cast<uint8_t>((position_offset + pos.pos.x - size.radius) / kQuadPixelSize),
-		static_cast<uint8_t>((position_offset + pos.pos.y - size.radius) / kQuadPixelSize),
-		static_cast<uint8_t>(1 + ((position_offset + pos.pos.x + size.radius) / kQuadPixelSize)),
-		static_cast<uint8_t>(1 + ((position_offset + pos.pos.y + size.radius) / kQuadPixelSize)) };
+	const QuadTree<ECS::EntityId>::Region region{
+		static_cast<uint8_t>((kQuadPositionOffset + pos.pos.x - size.radius) / kQuadPixelSize),
+		static_cast<uint8_t>((kQuadPositionOffset + pos.pos.y - size.radius) / kQuadPixelSize),
+		static_cast<uint8_t>(1 + ((kQuadPositionOffset + pos.pos.x + size.radius) / kQuadPixelSize)),
+		static_cast<uint8_t>(1 + ((kQuadPositionOffset + pos.pos.y + size.radius) / kQuadPixelSize)) };
+	return region;
 }
 
+struct RenderItem
+{
+	sf::Vector2f position;
+	float radius = 0.0f;
+	sf::Color color;
+};
+RenderSnapshot<RenderItem> render_snapshot;
+
 void GraphicSystem_Update(ECS::EntityId
 	, const Position& pos
+	, const PreviousPosition& previous
 	, const CircleSize& size
 	, Sprite2D& sprite)
 {
-	sprite.shape.setPosition(pos.pos - sf::Vector2f(size.radius, size.radius));
-	if (sprite.shape.getRadius() != size.radius)
+	const sf::Vector2f interpolated = previous.pos + (pos.pos - previous.pos) * BaseGameInstance::inst->render_alpha;
+	sprite.shape.setPosition(interpolated - sf::Vector2f(size.radius, size.radius));
+	if (BaseGameInstance::inst->pipelined_render)
 	{
-		sprite.shape.setRadius(size.radius);
+		const int64_t frame = static_cast<int64_t>(BaseGameInstance::inst->frames);
+		render_snapshot.ToWrite(frame).push_back(RenderItem{ sprite.shape.getPosition(), size.radius, sprite.shape.getFillColor() });
 	}
 }
 
+// Called with Filter<Changed<CircleSize>>, only for the circles resized since the previous run.
+void GraphicSystem_UpdateRadius(ECS::EntityId
+	, const CircleSize& size
+	, Sprite2D& sprite)
+{
+	sprite.shape.setRadius(size.radius);
+}
+
+void GraphicSystem_PublishSnapshot(ECS::TaskChunk)
+{
+	BaseGameInstance::inst->PublishSnapshot(static_cast<int64_t>(BaseGameInstance::inst->frames));
+}
+
 void GraphicSystem_RenderSync(ECS::EntityId, const Sprite2D& sprite)
 {
 	BaseGameInstance::inst->window.draw(sprite.shape);
 }
 
-class OutOfBoardEvent : public ECS::IEvent
+void QuadTreeRebuild_Count(ECS::EntityId
+	, const Position& pos
+	, const CircleSize& size)
 {
-	ECS::EntityHandle entity;
-public:
-	void Execute()
+	BaseGameInstance::inst->rebuilt_quad_tree.Count(ECS::ECSManagerAsync::CurrentChunk().index, ToRegion(pos, size));
+}
+
+void QuadTreeRebuild_Prefix(ECS::TaskChunk chunk)
+{
+	BaseGameInstance::inst->rebuilt_quad_tree.Prefix(chunk.index, chunk.num);
+}
+
+void QuadTreeRebuild_Scatter(ECS::EntityId id
+	, const Position& pos
+	, const CircleSize& size)
+{
+	BaseGameInstance::inst->rebuilt_quad_tree.Scatter(ECS::ECSManagerAsync::CurrentChunk().index, id, ToRegion(pos, size));
+}
+
+void Broadphase_GeneratePairs(ECS::TaskChunk chunk)
+{
+	auto& inst = *BaseGameInstance::inst;
+	assert(chunk.num == BaseGameInstance::kBroadphaseParts);
+	std::vector<ECS::EntityPair> phased_pairs[BaseGameInstance::kBroadphasePhases];
+	for (uint32_t phase = 0; phase < BaseGameInstance::kBroadphasePhases; phase++)
 	{
-		auto& ecs = BaseGameInstance::inst->ecs;
-		QuadTree<ECS::EntityId>::Region region = ToRegion(ecs.GetComponent<Position>(entity), ecs.GetComponent<CircleSize>(entity));
-		BaseGameInstance::inst->quad_tree.Remove(entity, region);
-		BaseGameInstance::inst->ecs.RemoveEntity(entity);
+		phased_pairs[phase].swap(inst.broadphase_pairs[phase][chunk.index]);
+		phased_pairs[phase].clear();
 	}
-	OutOfBoardEvent(ECS::EntityHandle eh) : entity(eh) {}
+	std::vector<ECS::EntityPair> serial_pairs;
+	serial_pairs.swap(inst.broadphase_serial_pairs[chunk.index]);
+	serial_pairs.clear();
+	const CircleSize* sizes = CircleSize::GetContainer().GetData();
+	const auto columns = QuadTree<ECS::EntityId>::Region::Columns(chunk.index, chunk.num, kPairPhaseBlock);
+	inst.GetQuadTree().GeneratePhasedPairs(columns, kPairPhaseBlock, phased_pairs, serial_pairs
+		, [sizes](ECS::EntityId id) { return ExceedsPairPhaseBlock(sizes[id]); });
+	for (uint32_t phase = 0; phase < BaseGameInstance::kBroadphasePhases; phase++)
+	{
+		phased_pairs[phase].swap(inst.broadphase_pairs[phase][chunk.index]);
+	}
+	serial_pairs.swap(inst.broadphase_serial_pairs[chunk.index]);
+}
+
+struct OutOfBoardEvent
+{
+	ECS::EntityHandle entity;
 };
 
+void OutOfBoard_Handle(const OutOfBoardEvent* events, std::size_t num)
+{
+	auto& ecs = BaseGameInstance::inst->ecs;
+	for (std::size_t idx = 0; idx < num; idx++)
+	{
+		ecs.RemoveEntity(events[idx].entity);
+	}
+}
+
+// The incrementally updated quad tree is maintained by Position observers. The region is kept to remove the entity later.
+std::array<QuadTree<ECS::EntityId>::Region, ECS::kMaxEntityNum> quad_tree_regions;
+
+void QuadTree_OnAddPosition(const ECS::EntityHandle* entities, std::size_t num)
+{
+	auto& inst = *BaseGameInstance::inst;
+	const auto& ecs = inst.ecs;
+	for (std::size_t idx = 0; idx < num; idx++)
+	{
+		const ECS::EntityId id = entities[idx];
+		quad_tree_regions[id] = ToRegion(ecs.GetComponent<Position>(id), ecs.GetComponent<CircleSize>(id));
+		inst.quad_tree.Add(id, quad_tree_regions[id]);
+	}
+}
+
+void QuadTree_OnRemovePosition(const ECS::EntityHandle* entities, std::size_t num)
+{
+	auto& inst = *BaseGameInstance::inst;
+	for (std::size_t idx = 0; idx < num; idx++)
+	{
+		const ECS::EntityId id = entities[idx];
+		inst.quad_tree.Remove(id, quad_tree_regions[id]);
+	}
+}
+
+ECS::EventChannel<OutOfBoardEvent> out_of_board_events{ &OutOfBoard_Handle };
+
 void GameMovement_Update(ECS::EntityId id
 	, Position& pos
+	, PreviousPosition& previous
 	, Velocity& vel
 	, const CircleSize& size)
 {
+	previous.pos = pos.pos;
 	if (	((pos.pos.x - size.radius) < 0	 && vel.velocity.x < 0)
 		||	((pos.pos.x + size.radius) > 800 && vel.velocity.x > 0))
 	{
@@ -59,51 +167,75 @@ void GameMovement_Update(ECS::EntityId id
 		||	((pos.pos.y + size.radius) > 600 && vel.velocity.y > 0))
 	{
 		//const auto eh = GResource::inst->ecs.GetHandle(id);
-		//GResource::inst->event_manager.Push(ECS::EventStorage::Create<OutOfBoardEvent>(eh));
+		//out_of_board_events.Push(OutOfBoardEvent{ eh }, id);
 		vel.velocity.y = -vel.velocity.y;
 	}
 	
+	const float scale_speed = 200.0f;
+	if (BaseGameInstance::inst->rebuild_quad_tree)
+	{
+		pos.pos += vel.velocity * scale_speed * BaseGameInstance::inst->frame_time_seconds;
+	}
+	else
 	{
 		auto& qt = BaseGameInstance::inst->quad_tree;
-		qt.Remove(id, ToRegion(pos, size));
-		const float scale_speed = 200.0f;
+		QuadTree<ECS::EntityId>::Region& region = quad_tree_regions[id];
+		qt.Remove(id, region);
 		pos.pos += vel.velocity * scale_speed * BaseGameInstance::inst->frame_time_seconds;
-		qt.Add(id, ToRegion(pos, size));
+		region = ToRegion(pos, size);
+		qt.Add(id, region);
 	}
 }
 
-struct TestOverlap_Holder
+const float kTestOverlapUpdateTime = 0.0001f;
+
+// Circle overlap response over a pair buffer.
+// Hits are found with the velocities from before the batch and confirmed one by one before the response.
+static void TestOverlap_Pairs(const std::vector<ECS::EntityPair>& pairs, std::vector<uint32_t>& hits)
 {
-	ECS::EntityId id;
-	const Position& pos; 
-	const CircleSize& size; 
-	Velocity& vel;
+	static_assert(sizeof(Position) == 2 * sizeof(float), "");
+	static_assert(sizeof(CircleSize) == sizeof(float), "");
+	static_assert(sizeof(Velocity) == 2 * sizeof(float), "");
+	auto& inst = *BaseGameInstance::inst;
+	Position* positions = Position::GetContainer().GetData();
+	CircleSize* sizes = CircleSize::GetContainer().GetData();
+	Velocity* velocities = Velocity::GetContainer().GetData();
+	const CircleBodies bodies{ &positions[0].pos.x, &positions[0].pos.y, 2
+		, &sizes[0].radius, 1
+		, &velocities[0].velocity.x, &velocities[0].velocity.y, 2 };
 
-	QuadTree<ECS::EntityId>::Region region;
-	QuadTree<ECS::EntityId>::Iter GetIter(std::vector<uint8_t>& in_memory) const
+	hits.resize(pairs.size());
+	const uint32_t hits_num = FindApproachingCircleOverlaps(pairs.data(), static_cast<uint32_t>(pairs.size())
+		, bodies, kTestOverlapUpdateTime, hits.data());
+	for (uint32_t idx = 0; idx < hits_num; idx++)
 	{
-		assert(region.IsValid());
-		return QuadTree<ECS::EntityId>::Iter(id, region, BaseGameInstance::inst->quad_tree, in_memory);
+		const ECS::EntityPair& pair = pairs[hits[idx]];
+		if (inst.ecs.HasComponent<Velocity>(pair.a) && inst.ecs.HasComponent<Velocity>(pair.b)
+			&& ApproachingCircleOverlap(bodies, pair.a, pair.b, kTestOverlapUpdateTime))
+		{
+			std::swap(velocities[pair.a].velocity, velocities[pair.b].velocity);
+			Velocity::GetContainer().MarkChanged(pair.a); // written through GetData
+			Velocity::GetContainer().MarkChanged(pair.b);
+		}
 	}
-};
+}
 
-TestOverlap_Holder TestOverlap_FirstPass(ECS::EntityId id, const Position& pos, const CircleSize& size, Velocity& vel)
+// The broadphase pairs of one phase and one part.
+template<uint32_t kPhase>
+void TestOverlap_Narrowphase(ECS::TaskChunk chunk)
 {
-	return TestOverlap_Holder{ id, pos, size, vel, ToRegion(pos, size) };
+	static_assert(kPhase < BaseGameInstance::kBroadphasePhases, "");
+	assert(chunk.num == BaseGameInstance::kBroadphaseParts);
+	auto& inst = *BaseGameInstance::inst;
+	TestOverlap_Pairs(inst.broadphase_pairs[kPhase][chunk.index], inst.narrowphase_hits[chunk.index]);
 }
 
-void TestOverlap_SecondPass(TestOverlap_Holder& first_pass, ECS::EntityId, const Position& pos, const CircleSize& size, Velocity& vel)
+// The pairs with a circle too big for the phases, in a single task after all phases.
+void TestOverlap_Serial(ECS::TaskChunk)
 {
-	const sf::Vector2f diff = (pos.pos - first_pass.pos.pos);
-	const float dist_sq = diff.x * diff.x + diff.y * diff.y;
-	const float radius_sum_sq = (first_pass.size.radius + size.radius) * (first_pass.size.radius + size.radius);
-	
-	const float update_time = 0.0001f;
-	const sf::Vector2f next_diff = diff + (vel.velocity - first_pass.vel.velocity) * update_time;
-	const float next_dist_sq = next_diff.x * next_diff.x + next_diff.y * next_diff.y;
-
-	if ((dist_sq < radius_sum_sq) && (next_dist_sq < dist_sq))
+	auto& inst = *BaseGameInstance::inst;
+	for (uint32_t part = 0; part < BaseGameInstance::kBroadphaseParts; part++)
 	{
-		std::swap(first_pass.vel.velocity, vel.velocity);
+		TestOverlap_Pairs(inst.broadphase_serial_pairs[part], inst.narrowphase_hits[0]);
 	}
 }